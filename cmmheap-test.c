@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <time.h>
 #include <math.h>
+#include <unistd.h>
 #include "fastclock.h"
 #include "miniprng.h"
 
@@ -16,31 +17,25 @@
 long rnd_state = -1.0;
 
 // Sorting functions; ksmallest and klargest, derived from the min-max-heap; O(n log k). Returns min(n,k)
+// If ik is NULL only the values are kept (keys-only heap).
 int ksmallest(double *x,int n,int k,double *xk,int *ik) {
   // x is a length-n array of real numbers, find the k smallest numbers
   // and store them sorted into xk and their indices in ik.
-  minmaxheap *pheap = mmheap_create(k);
-  // iterate through the array and maintain the size-k heap
+  minmaxheap *pheap = (ik ? mmheap_create(k) : mmheap_create_keys(k));
+  // fill the heap, then skip ahead to the next element below the current max
   int i;
-  for (i=0;i<n;i++) {
-    if (mmheap_getlength(pheap)==k) {
-      // need to remove the largest element before inserting the next, if it should be inserted at all
-      if (x[i]<mmheap_peekmax_value(pheap)) {
-        mmheap_removemax(pheap);
-        mmheap_insert(pheap,x[i],i);
-      }
-    } else {
-      mmheap_insert(pheap,x[i],i);
-    }
+  for (i=0;i<n && i<k;i++) {
+    mmheap_insert(pheap,x[i],i);
   }
-  // empty heap contents to output arrays
-  i = 0;
-  while (mmheap_getlength(pheap)) {
-    xk[i] = mmheap_peekmin_value(pheap);
-    ik[i] = mmheap_peekmin_index(pheap);
-    mmheap_removemin(pheap);
+  while (i<n) {
+    i += mmheap_scan_below(x+i,n-i,mmheap_peekmax_value(pheap));
+    if (i==n)
+      break;
+    mmheap_replacemax(pheap,x[i],i);
     i++;
   }
+  // empty heap contents to output arrays
+  i = mmheap_drain_ascending(pheap,xk,ik);
   mmheap_destroy(pheap);
   return i;
 }
@@ -48,34 +43,41 @@ int ksmallest(double *x,int n,int k,double *xk,int *ik) {
 int klargest(double *x,int n,int k,double *xk,int *ik) {
   // x is a length-n array of real numbers, find the k largest numbers
   // and store them sorted into xk and their indices in ik.
-  minmaxheap *pheap = mmheap_create(k);
-  // iterate through the array and maintain the size-k heap
+  minmaxheap *pheap = (ik ? mmheap_create(k) : mmheap_create_keys(k));
+  // fill the heap, then skip ahead to the next element above the current min
   int i;
-  for (i=0;i<n;i++) {
-    if (mmheap_getlength(pheap)==k) {
-      // need to remove the largest element before inserting the next, if it should be inserted at all
-      if (x[i]>mmheap_peekmin_value(pheap)) {
-        mmheap_removemin(pheap);
-        mmheap_insert(pheap,x[i],i);
-      }
-    } else {
-      mmheap_insert(pheap,x[i],i);
-    }
+  for (i=0;i<n && i<k;i++) {
+    mmheap_insert(pheap,x[i],i);
   }
-  // empty heap contents to output arrays
-  i = 0;
-  while (mmheap_getlength(pheap)) {
-    xk[i] = mmheap_peekmax_value(pheap);
-    ik[i] = mmheap_peekmax_index(pheap);
-    mmheap_removemax(pheap);
+  while (i<n) {
+    i += mmheap_scan_above(x+i,n-i,mmheap_peekmin_value(pheap));
+    if (i==n)
+      break;
+    mmheap_replacemin(pheap,x[i],i);
     i++;
   }
+  // empty heap contents to output arrays
+  i = mmheap_drain_descending(pheap,xk,ik);
   mmheap_destroy(pheap);
   return i;
 }
 
 // Benchmarking
 
+// IPC and hardware counter events per element of a region over n elements
+void print_counters(const fclk_counters *pc,int n,const char *label) {
+  const char *names[FCLK_NCOUNTERS] = {"cycles","instructions","branch misses","L1D misses","LLC misses"};
+  int c,m = 0;
+  printf("[%s] counters:",label);
+  if (fclk_counters_ipc(pc)>=0.0)
+    printf("%s IPC %f",(m++ ? "," : ""),fclk_counters_ipc(pc));
+  for (c=0;c<FCLK_NCOUNTERS;c++) {
+    if (pc->valid[c])
+      printf("%s %s/elem %f",(m++ ? "," : ""),names[c],fclk_counters_per(pc,c,n));
+  }
+  printf("%s\n",(m ? "" : " not available (time only)"));
+}
+
 int __qsort_comparefun(const void* a,const void* b)
 {
   double va = *(double*) a;
@@ -154,16 +156,18 @@ void compare_mmheap_to_qsort(int n,int k)
   //  printf("qsort #%i: %f\n",i+1,y[i]);
   //}
   
+  fclk_counters pc;
+  fclk_counters_open(&pc);
+  fclk_counters_start(&pc);
   fclk_timestamp(&__tic);
   // iterate through the array and maintain the size-k heap
   for (i=0;i<n;i++) {
     if (mmheap_getlength(pheap)==k) {
-      // need to remove the largest element before inserting the next, if it should be inserted at all
+      // replace the largest element by the next one, if it should be inserted at all
       double maxheapval = mmheap_peekmax_value(pheap);
       if (x[i]<maxheapval) {
-        mmheap_removemax(pheap);
-        if (!mmheap_insert(pheap,x[i],i)) {
-          printf("insert to heap failed for (%f,%i).\n",x[i],i);
+        if (!mmheap_replacemax(pheap,x[i],i)) {
+          printf("replace in heap failed for (%f,%i).\n",x[i],i);
         }
       }
     } else {
@@ -173,8 +177,225 @@ void compare_mmheap_to_qsort(int n,int k)
     }
   }
   fclk_timestamp(&__toc);
+  fclk_counters_stop(&pc);
+  fclk_counters_close(&pc);
   elap_ksort = fclk_delta_timestamps(&__tic, &__toc);
   printf("[ksort] elapsed: %f us (excluded malloc/free)\n", elap_ksort * 1.0e6);
+  print_counters(&pc,n,"ksort");
+
+  // same selection via ksmallest(); prefiltered scan and sorted output stage
+  double *xk = (double *)malloc(sizeof(double)*k);
+  int *ik = (int *)malloc(sizeof(int)*k);
+  fclk_timestamp(&__tic);
+  ksmallest(x,n,k,xk,ik);
+  fclk_timestamp(&__toc);
+  elap_ksort = fclk_delta_timestamps(&__tic, &__toc);
+  printf("[ksmallest] elapsed: %f us (incl. sorted output)\n", elap_ksort * 1.0e6);
+  for (i=0;i<k;i++) {
+    if (y[i]!=xk[i] || y[i]!=x[ik[i]]) {
+      printf("ksmallest mismatch found @ pos = %i\n",i+1);
+    }
+  }
+
+  // and with a keys-only heap (no index array)
+  fclk_timestamp(&__tic);
+  ksmallest(x,n,k,xk,NULL);
+  fclk_timestamp(&__toc);
+  elap_ksort = fclk_delta_timestamps(&__tic, &__toc);
+  printf("[ksmallest keys-only] elapsed: %f us (incl. sorted output)\n", elap_ksort * 1.0e6);
+  for (i=0;i<k;i++) {
+    if (y[i]!=xk[i]) {
+      printf("ksmallest keys-only mismatch found @ pos = %i\n",i+1);
+    }
+  }
+  free(xk);
+  free(ik);
+
+  // build a heap of all n elements: n inserts vs bottom-up heapify
+  minmaxheap *pfull = mmheap_create(n);
+  fclk_timestamp(&__tic);
+  for (i=0;i<n;i++) {
+    mmheap_insert(pfull,x[i],i);
+  }
+  fclk_timestamp(&__toc);
+  double elap_insert = fclk_delta_timestamps(&__tic, &__toc);
+  mmheap_destroy(pfull);
+  fclk_timestamp(&__tic);
+  pfull = mmheap_create_from(x,NULL,n);
+  fclk_timestamp(&__toc);
+  double elap_build = fclk_delta_timestamps(&__tic, &__toc);
+  printf("[build n] elapsed: %f us (n inserts), %f us (mmheap_create_from)\n", elap_insert * 1.0e6, elap_build * 1.0e6);
+  for (i=0;i<k;i++) {
+    if (y[i]!=mmheap_peekmin_value(pfull) || y[n-1-i]!=mmheap_peekmax_value(pfull)) {
+      printf("mmheap_create_from mismatch found @ pos = %i\n",i+1);
+    }
+    mmheap_removemin(pfull);
+    if (mmheap_getlength(pfull)>0)
+      mmheap_removemax(pfull);
+    if (mmheap_getlength(pfull)==0)
+      break;
+  }
+  mmheap_destroy(pfull);
+  
+  // merge the two halves of x: drain-and-insert vs mmheap_merge / mmheap_merge_bounded
+  int h1 = n/2;
+  minmaxheap *pa = mmheap_create_from(x,NULL,h1);
+  minmaxheap *pb = mmheap_create(n-h1>0 ? n-h1 : 1);
+  for (i=h1;i<n;i++)
+    mmheap_insert(pb,x[i],i);
+  minmaxheap *pm = mmheap_copy(pa);
+  minmaxheap *pd = mmheap_copy(pb);
+  mmheap_reserve(pm,n);
+  fclk_timestamp(&__tic);
+  while (mmheap_getlength(pd)>0) {
+    mmheap_insert(pm,mmheap_peekmin_value(pd),mmheap_peekmin_index(pd));
+    mmheap_removemin(pd);
+  }
+  fclk_timestamp(&__toc);
+  double elap_naive = fclk_delta_timestamps(&__tic, &__toc);
+  mmheap_destroy(pm);
+  mmheap_destroy(pd);
+  pm = mmheap_copy(pa);
+  mmheap_reserve(pm,n);
+  fclk_timestamp(&__tic);
+  mmheap_merge(pm,pb);
+  fclk_timestamp(&__toc);
+  double elap_merge = fclk_delta_timestamps(&__tic, &__toc);
+  minmaxheap *pk = mmheap_copy(pa);
+  mmheap_reserve(pk,k);
+  fclk_timestamp(&__tic);
+  mmheap_merge_bounded(pk,pb,k,0);
+  fclk_timestamp(&__toc);
+  double elap_bounded = fclk_delta_timestamps(&__tic, &__toc);
+  printf("[merge n] elapsed: %f us (drain-and-insert), %f us (mmheap_merge), %f us (mmheap_merge_bounded k)\n",
+         elap_naive * 1.0e6, elap_merge * 1.0e6, elap_bounded * 1.0e6);
+  for (i=0;i<n;i++) {
+    if (y[i]!=mmheap_peekmin_value(pm) || (i<k && y[i]!=mmheap_peekmin_value(pk))) {
+      printf("mmheap_merge mismatch found @ pos = %i\n",i+1);
+    }
+    mmheap_removemin(pm);
+    mmheap_removemin(pk);
+  }
+  mmheap_destroy(pa);
+  mmheap_destroy(pb);
+  mmheap_destroy(pm);
+  mmheap_destroy(pk);
+  
+  // output stage of k elements: peek-and-remove loop vs mmheap_drain_ascending
+  double *xo = (double *) malloc(sizeof(double)*k);
+  int *io = (int *) malloc(sizeof(int)*k);
+  pa = mmheap_create(k);
+  mmheap_assign(pa,x,NULL,k);
+  pb = mmheap_copy(pa);
+  fclk_timestamp(&__tic);
+  for (i=0;mmheap_getlength(pa)>0;i++) {
+    xo[i] = mmheap_peekmin_value(pa);
+    io[i] = mmheap_peekmin_index(pa);
+    mmheap_removemin(pa);
+  }
+  fclk_timestamp(&__toc);
+  double elap_loop = fclk_delta_timestamps(&__tic, &__toc);
+  fclk_timestamp(&__tic);
+  mmheap_drain_ascending(pb,xo,io);
+  fclk_timestamp(&__toc);
+  double elap_drain = fclk_delta_timestamps(&__tic, &__toc);
+  printf("[drain k] elapsed: %f us (peek/remove loop), %f us (mmheap_drain_ascending)\n", elap_loop * 1.0e6, elap_drain * 1.0e6);
+  for (i=0;i<k;i++) {
+    if ((i>0 && xo[i]<xo[i-1]) || x[io[i]]!=xo[i]) {
+      printf("mmheap_drain_ascending mismatch found @ pos = %i\n",i+1);
+    }
+  }
+  mmheap_destroy(pa);
+  mmheap_destroy(pb);
+  free(xo);
+  free(io);
+
+  // snapshot of an n-element heap: rebuild from x vs mmheap_save / mmheap_load
+  char path[] = "/tmp/cmmheap-test-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd>=0) {
+    close(fd);
+    fclk_timestamp(&__tic);
+    pa = mmheap_create(n);
+    mmheap_assign(pa,x,NULL,n);
+    fclk_timestamp(&__toc);
+    double elap_rebuild = fclk_delta_timestamps(&__tic, &__toc);
+    fclk_timestamp(&__tic);
+    int saved = mmheap_save(pa,path);
+    fclk_timestamp(&__toc);
+    double elap_save = fclk_delta_timestamps(&__tic, &__toc);
+    fclk_timestamp(&__tic);
+    pb = mmheap_load(path);
+    fclk_timestamp(&__toc);
+    double elap_load = fclk_delta_timestamps(&__tic, &__toc);
+    printf("[snapshot n] elapsed: %f us (rebuild), %f us (mmheap_save), %f us (mmheap_load)\n",
+           elap_rebuild * 1.0e6, elap_save * 1.0e6, elap_load * 1.0e6);
+    if (!saved || pb==NULL || pb->length!=n || pb->maxlength!=n
+        || memcmp(pa->value,pb->value,sizeof(double)*n) || memcmp(pa->index,pb->index,sizeof(int)*n)) {
+      printf("mmheap_load mismatch found\n");
+    }
+    // a flipped bit must fail the checksum
+    FILE *f = fopen(path,"r+b");
+    fseek(f,64+sizeof(double)*(n/2),SEEK_SET);
+    int c = fgetc(f);
+    fseek(f,64+sizeof(double)*(n/2),SEEK_SET);
+    fputc(c^1,f);
+    fclose(f);
+    minmaxheap *pc = mmheap_load(path);
+    if (pc!=NULL) {
+      printf("mmheap_load accepted a corrupted snapshot\n");
+      mmheap_destroy(pc);
+    }
+    // so must a huge capacity in the header, without allocating it first
+    int big = 0x7fffffff;
+    mmheap_save(pa,path);
+    f = fopen(path,"r+b");
+    fseek(f,20,SEEK_SET);
+    fwrite(&big,sizeof(int),1,f);
+    fclose(f);
+    pc = mmheap_load(path);
+    if (pc!=NULL) {
+      printf("mmheap_load accepted a corrupted capacity\n");
+      mmheap_destroy(pc);
+    }
+    // a heap of capacity 0 loads back with capacity 1
+    pc = mmheap_create_keys(0);
+    minmaxheap *pd = (mmheap_save(pc,path) ? mmheap_load(path) : NULL);
+    if (pd==NULL || pd->length!=0 || pd->maxlength!=1 || pd->index!=NULL)
+      printf("mmheap_load mismatch found (capacity 0)\n");
+    mmheap_destroy(pc);
+    if (pd!=NULL)
+      mmheap_destroy(pd);
+    // the save goes through path.tmp, which is gone afterwards
+    char tmppath[sizeof(path)+4];
+    sprintf(tmppath,"%s.tmp",path);
+    if (access(tmppath,F_OK)==0)
+      printf("mmheap_save left %s behind\n",tmppath);
+    remove(path);
+    mmheap_destroy(pa);
+    if (pb!=NULL)
+      mmheap_destroy(pb);
+  }
+
+  // instrumentation counters of a bounded k-smallest pass (make cmmheap-test-stats)
+#ifdef CMMHEAP_STATS
+  mmheap_stats st;
+  int m = (n<k ? n : k);
+  pa = mmheap_create(k);
+  mmheap_stats_reset();
+  for (i=0;i<n;i++)
+    mmheap_insert_or_evictmax(pa,x[i],i,NULL,NULL);
+  mmheap_stats_get(&st);
+  printf("[stats k] compares/elem %f, swaps/elem %f, bubble up %llu (max %llu), trickle down %llu (max %llu), rejects %llu, evictions %llu\n",
+         (double)st.compares/n,(double)st.swaps/n,st.bubble_ups,st.bubble_max,st.trickle_downs,st.trickle_max,st.rejects,st.evictions);
+  if (st.bubble_ups!=(unsigned long long)m || st.trickle_downs!=st.evictions
+      || st.rejects+st.evictions!=(unsigned long long)(n-m) || st.swaps<st.bubble_steps+st.trickle_steps) {
+    printf("mmheap_stats mismatch found\n");
+  }
+  mmheap_destroy(pa);
+#else
+  printf("[stats k] not compiled in (build with -DCMMHEAP_STATS)\n");
+#endif
   
   // print out smallest min(n,k) elements
   i = 0;
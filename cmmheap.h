@@ -4,6 +4,10 @@
  *
  * each object in the heap has a pair of properties: ("value","index").
  * the heap property is based on "value".
+ * a heap made with mmheap_create_keys() stores values only (index==NULL);
+ * its index arguments are ignored and its index peeks return NAI.
+ * a heap is fixed-size unless made growable with mmheap_set_growable();
+ * then insert doubles its capacity (realloc) when it is full.
  *
  * implementation based on original source:
  *    Atkinson, Sack, Santoro, Strothotte,
@@ -21,11 +25,17 @@
 
 #define NAI (-1)    // not an index
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(CMMHEAP_NO_SIMD)
+#include <immintrin.h>
+#define __CMMHEAP_X86_SIMD
+#endif
+
 typedef struct {
   double *value;
   int *index;
   int length;
   int maxlength;
+  int growable;
 } minmaxheap;
 
 // Create and Destroy procedures
@@ -36,6 +46,17 @@ minmaxheap *mmheap_create(int maxlength) {
   pheap->index = (int *) malloc(sizeof(int)*maxlength);
   pheap->maxlength = maxlength;
   pheap->length = 0;
+  pheap->growable = 0;
+  return pheap;
+}
+
+minmaxheap *mmheap_create_keys(int maxlength) {
+  minmaxheap *pheap = (minmaxheap *) malloc(sizeof(minmaxheap));
+  pheap->value = (double *) malloc(sizeof(double)*maxlength);
+  pheap->index = NULL;
+  pheap->maxlength = maxlength;
+  pheap->length = 0;
+  pheap->growable = 0;
   return pheap;
 }
 
@@ -44,11 +65,15 @@ minmaxheap *mmheap_copy(minmaxheap *psource) {
   int length = psource->length;
   minmaxheap *pheap = (minmaxheap *) malloc(sizeof(minmaxheap));
   pheap->value = (double *) malloc(sizeof(double)*maxlength);
-  pheap->index = (int *) malloc(sizeof(int)*maxlength);
+  pheap->index = NULL;
   pheap->maxlength = maxlength;
   pheap->length = length;
+  pheap->growable = psource->growable;
   memcpy((void *)(pheap->value),(void *)(psource->value),sizeof(double)*length);
-  memcpy((void *)(pheap->index),(void *)(psource->index),sizeof(int)*length);
+  if (psource->index) {
+    pheap->index = (int *) malloc(sizeof(int)*maxlength);
+    memcpy((void *)(pheap->index),(void *)(psource->index),sizeof(int)*length);
+  }
   return pheap;
 }
 
@@ -58,6 +83,43 @@ void mmheap_destroy(minmaxheap *mmheap) {
   free(mmheap);
 }
 
+// Capacity changes; return 0 (heap unchanged) if out of memory
+
+static int __mmheap_resize(minmaxheap *mmheap,int maxlength) {
+  if (maxlength<1)
+    maxlength = 1;
+  double *A = (double *) realloc(mmheap->value,sizeof(double)*maxlength);
+  if (A==NULL)
+    return 0;
+  mmheap->value = A;
+  if (mmheap->index) {
+    int *B = (int *) realloc(mmheap->index,sizeof(int)*maxlength);
+    if (B!=NULL)
+      mmheap->index = B;
+    else if (maxlength>mmheap->maxlength)
+      return 0;  // A grew, which is harmless; a failed shrink of B is too
+  }
+  mmheap->maxlength = maxlength;
+  return 1;
+}
+
+static int mmheap_reserve(minmaxheap *mmheap,int maxlength) {
+  if (maxlength<=mmheap->maxlength)
+    return 1;
+  return __mmheap_resize(mmheap,maxlength);
+}
+
+static int mmheap_shrink_to_fit(minmaxheap *mmheap) {
+  int maxlength = (mmheap->length>0 ? mmheap->length : 1);
+  if (maxlength==mmheap->maxlength)
+    return 1;
+  return __mmheap_resize(mmheap,maxlength);
+}
+
+static void mmheap_set_growable(minmaxheap *mmheap,int growable) {
+  mmheap->growable = growable;
+}
+
 // Auxiliary functions
 
 // for i:   0,1,2,3,4,5,6,7,8,9,...
@@ -66,213 +128,232 @@ void mmheap_destroy(minmaxheap *mmheap) {
 static int msbpos(int i) {
   if (i<=0)
     return 0;
+#if defined(__GNUC__)
+  return 32-__builtin_clz((unsigned int)i);
+#else
   int r = 1;
   while (i >>= 1) {
     r++;
   }
   return r;
+#endif
 }
 
 // 1-based index i
 static int isminlevel(int i) {
-  if (msbpos(i) & 1) {
-    return 1;  // odd level is min-level (1,3,5,...)
-  } else {
-    return 0;  // even level is max-level (2,4,6,...)
-  }
+  return msbpos(i) & 1;  // odd level is min-level (1,3,5,...), even level is max-level (2,4,6,...)
+}
+
+// Instrumentation; compile with -DCMMHEAP_STATS to count key compares,
+// swaps, bubble up and trickle down calls and steps (max: deepest single
+// call), inserts rejected by a full heap or by insert_or_evict, and
+// evictions (replacemin/replacemax). The counters are shared by all heaps
+// of the translation unit and not thread-safe. Without the macro the hooks
+// compile to nothing and mmheap_stats_get returns zeros.
+
+typedef struct {
+  unsigned long long compares;
+  unsigned long long swaps;
+  unsigned long long bubble_ups;
+  unsigned long long bubble_steps;
+  unsigned long long bubble_max;
+  unsigned long long trickle_downs;
+  unsigned long long trickle_steps;
+  unsigned long long trickle_max;
+  unsigned long long rejects;
+  unsigned long long evictions;
+} mmheap_stats;
+
+#ifdef CMMHEAP_STATS
+static mmheap_stats __mmheap_stats;
+static unsigned long long __mmheap_depth;
+#define __MMHEAP_STAT(f,n) (__mmheap_stats.f+=(n))
+#define __MMHEAP_STAT_CALL(f) (__mmheap_stats.f++,__mmheap_depth=0)
+#define __MMHEAP_STAT_STEP(f,fmax) (__mmheap_stats.f++,__mmheap_stats.swaps++, \
+  (++__mmheap_depth>__mmheap_stats.fmax ? (void)(__mmheap_stats.fmax=__mmheap_depth) : (void)0))
+#else
+#define __MMHEAP_STAT(f,n) ((void)0)
+#define __MMHEAP_STAT_CALL(f) ((void)0)
+#define __MMHEAP_STAT_STEP(f,fmax) ((void)0)
+#endif
+
+static void mmheap_stats_get(mmheap_stats *stats) {
+#ifdef CMMHEAP_STATS
+  *stats = __mmheap_stats;
+#else
+  memset(stats,0,sizeof(mmheap_stats));
+#endif
+}
+
+static void mmheap_stats_reset(void) {
+#ifdef CMMHEAP_STATS
+  memset(&__mmheap_stats,0,sizeof(mmheap_stats));
+  __mmheap_depth = 0;
+#endif
 }
 
+// B may be NULL (keys-only heap)
+
 static void __ab_swap(double *A,int *B,int i,int j) {
   double tmpa = A[j];
   A[j] = A[i];
   A[i] = tmpa;
-  int tmpb = B[j];
-  B[j] = B[i];
-  B[i] = tmpb;
+  if (B) {
+    int tmpb = B[j];
+    B[j] = B[i];
+    B[i] = tmpb;
+  }
+}
+
+static void __ab_set(double *A,int *B,int j,double v,int i) {
+  A[j] = v;
+  if (B)
+    B[j] = i;
+}
+
+static void __ab_copy(double *A,int *B,int dst,int src) {
+  A[dst] = A[src];
+  if (B)
+    B[dst] = B[src];
 }
 
-// bubble up is used for insertion
+// bubble up is used for insertion;
+// after the first step the element only moves between grandparents,
+// so the level type stays fixed
 
 static void __bubble_up_min(double *A,int *B,int i) {
-  int grandparenti = (i>>2);
-  if (grandparenti) {
-    //printf("@min #%i\t#%i\n",i,grandparenti);
-    if (A[i-1]<A[grandparenti-1]) {
-      __ab_swap(A,B,i-1,grandparenti-1);
-      __bubble_up_min(A,B,grandparenti);
-    }
+  int grandparenti;
+  for (grandparenti = (i>>2); grandparenti && (__MMHEAP_STAT(compares,1),A[i-1]<A[grandparenti-1]); grandparenti = (i>>2)) {
+    __ab_swap(A,B,i-1,grandparenti-1);
+    __MMHEAP_STAT_STEP(bubble_steps,bubble_max);
+    i = grandparenti;
   }
 }
 
 static void __bubble_up_max(double *A,int *B,int i) {
-  int grandparenti = (i>>2);
-  if (grandparenti) {
-    //printf("@max #%i\t#%i\n",i,grandparenti);
-    if (A[i-1]>A[grandparenti-1]) {
-      __ab_swap(A,B,i-1,grandparenti-1);
-      __bubble_up_max(A,B,grandparenti);
-    }
+  int grandparenti;
+  for (grandparenti = (i>>2); grandparenti && (__MMHEAP_STAT(compares,1),A[i-1]>A[grandparenti-1]); grandparenti = (i>>2)) {
+    __ab_swap(A,B,i-1,grandparenti-1);
+    __MMHEAP_STAT_STEP(bubble_steps,bubble_max);
+    i = grandparenti;
   }
 }
 
 static void __bubble_up(double *A,int *B,int i) {
   int parenti = (i>>1);
+  __MMHEAP_STAT_CALL(bubble_ups);
+  if (!parenti)
+    return;
+  __MMHEAP_STAT(compares,1);
   if (isminlevel(i)) {
-    if (parenti) {
-      //printf("@bubble #%i\t#%i\n",i,parenti);
-      if (A[i-1]>A[parenti-1]) {
-        __ab_swap(A,B,i-1,parenti-1);
-        __bubble_up_max(A,B,parenti);
-      } else {
-        __bubble_up_min(A,B,i);
-      }
+    if (A[i-1]>A[parenti-1]) {
+      __ab_swap(A,B,i-1,parenti-1);
+      __MMHEAP_STAT_STEP(bubble_steps,bubble_max);
+      __bubble_up_max(A,B,parenti);
     } else {
       __bubble_up_min(A,B,i);
     }
   } else {
-    if (parenti) { 
-      //printf("@bubble #%i\t#%i\n",i,parenti);
-      if (A[i-1]<A[parenti-1]) {
-        __ab_swap(A,B,i-1,parenti-1);
-        __bubble_up_min(A,B,parenti);
-      } else {
-        __bubble_up_max(A,B,i);
-      }
+    if (A[i-1]<A[parenti-1]) {
+      __ab_swap(A,B,i-1,parenti-1);
+      __MMHEAP_STAT_STEP(bubble_steps,bubble_max);
+      __bubble_up_min(A,B,parenti);
     } else {
       __bubble_up_max(A,B,i);
     }
   }
 }
 
-// trickle down is used for removal
+// trickle down is used for removal;
+// the element moves between grandchildren, so the level type stays fixed.
+// when all four grandchildren exist the extreme is always one of them
+// (each child bounds its own children) and it is picked without branches;
+// the general scan is only needed near the bottom of the heap.
 
 static void __trickle_down_min(double *A,int *B,int i,int maxi) {
-  int m;
-  int lchild = i << 1;    // children
-  if (lchild>maxi)
-    return;  // no children at all; nothing to do
-  int rchild = lchild + 1;
-  if (rchild<=maxi) {
-    // i has two children
-    if (A[lchild-1]<A[rchild-1]) {
-      m = lchild;
+  for (;;) {
+    int m;
+    int lchild = i << 1;    // children
+    int llchild = lchild << 1;  // first of four grandchildren
+    if (llchild+3<=maxi) {
+      int m1 = llchild+(A[llchild]<A[llchild-1]);
+      int m2 = llchild+2+(A[llchild+2]<A[llchild+1]);
+      m = (A[m2-1]<A[m1-1] ? m2 : m1);
+      __MMHEAP_STAT(compares,3);
     } else {
-      m = rchild;
-    }
-    // now find also grandchildren (could exist)
-    // no grandchildren exists unless there are two children
-    int llchild = lchild << 1;  // grandchildren
-    int lrchild = llchild + 1;
-    int rlchild = rchild << 1;
-    int rrchild = rlchild + 1;
-    if (llchild<=maxi) {
-      if (A[llchild-1]<A[m-1]) {
-        m = llchild;
-      }
-    }
-    if (lrchild<=maxi) {
-      if (A[lrchild-1]<A[m-1]) {
-        m = lrchild;
-      }
-    }
-    if (rlchild<=maxi) {
-      if (A[rlchild-1]<A[m-1]) {
-        m = rlchild;
-      }
-    }
-    if (rrchild<=maxi) {
-      if (A[rrchild-1]<A[m-1]) {
-        m = rrchild;
-      }
-    }
-  } else {
-    // i has only one child
-    m = lchild;
-  }
-  
-  // at this point m is the index of the minimum-value child or grandchild
-  if (m>rchild) {
-    // m is a grandchild
-    if (A[m-1]<A[i-1]) {
-      __ab_swap(A,B,i-1,m-1);
-      int parentm = m >> 1;
-      if (A[m-1]>A[parentm-1]) {
-        __ab_swap(A,B,m-1,parentm-1);
+      int g;
+      if (lchild>maxi)
+        return;  // no children at all; nothing to do
+      m = lchild;
+      if (lchild+1<=maxi && A[lchild]<A[lchild-1])
+        m = lchild+1;
+      for (g=llchild;g<=maxi;g++) {
+        if (A[g-1]<A[m-1])
+          m = g;
       }
-      __trickle_down_min(A,B,m,maxi);
+      __MMHEAP_STAT(compares,(lchild+1<=maxi)+(maxi>=llchild ? maxi-llchild+1 : 0));
     }
-  } else {
-    // m is child
-    if (A[m-1]<A[i-1]) {
-      __ab_swap(A,B,i-1,m-1);
+    // at this point m is the index of the minimum-value child or grandchild
+    __MMHEAP_STAT(compares,1);
+    if (!(A[m-1]<A[i-1]))
+      return;
+    __ab_swap(A,B,i-1,m-1);
+    __MMHEAP_STAT_STEP(trickle_steps,trickle_max);
+    if (m<llchild)
+      return;  // m is a child (and a leaf)
+    int parentm = m >> 1;
+    __MMHEAP_STAT(compares,1);
+    if (A[m-1]>A[parentm-1]) {
+      __ab_swap(A,B,m-1,parentm-1);
+      __MMHEAP_STAT(swaps,1);
     }
+    i = m;
   }
 }
 
 static void __trickle_down_max(double *A,int *B,int i,int maxi) {
-  int m;
-  int lchild = i << 1;    // children
-  if (lchild>maxi)
-    return;  // no children at all; nothing to do
-  int rchild = lchild + 1;
-  if (rchild<=maxi) {
-    // i has two children
-    if (A[lchild-1]>A[rchild-1]) {
-      m = lchild;
+  for (;;) {
+    int m;
+    int lchild = i << 1;    // children
+    int llchild = lchild << 1;  // first of four grandchildren
+    if (llchild+3<=maxi) {
+      int m1 = llchild+(A[llchild]>A[llchild-1]);
+      int m2 = llchild+2+(A[llchild+2]>A[llchild+1]);
+      m = (A[m2-1]>A[m1-1] ? m2 : m1);
+      __MMHEAP_STAT(compares,3);
     } else {
-      m = rchild;
-    }
-    // now find also grandchildren (could exist)
-    // no grandchildren exists unless there are two children
-    int llchild = lchild << 1;  // grandchildren
-    int lrchild = llchild + 1;
-    int rlchild = rchild << 1;
-    int rrchild = rlchild + 1;
-    if (llchild<=maxi) {
-      if (A[llchild-1]>A[m-1]) {
-        m = llchild;
-      }
-    }
-    if (lrchild<=maxi) {
-      if (A[lrchild-1]>A[m-1]) {
-        m = lrchild;
-      }
-    }
-    if (rlchild<=maxi) {
-      if (A[rlchild-1]>A[m-1]) {
-        m = rlchild;
-      }
-    }
-    if (rrchild<=maxi) {
-      if (A[rrchild-1]>A[m-1]) {
-        m = rrchild;
-      }
-    }
-  } else {
-    // i has only one child
-    m = lchild;
-  }
-  
-  // at this point m is the index of the maximum-value child or grandchild
-  if (m>rchild) {
-    // m is a grandchild
-    if (A[m-1]>A[i-1]) {
-      __ab_swap(A,B,i-1,m-1);
-      int parentm = m >> 1;
-      if (A[m-1]<A[parentm-1]) {
-        __ab_swap(A,B,m-1,parentm-1);
+      int g;
+      if (lchild>maxi)
+        return;  // no children at all; nothing to do
+      m = lchild;
+      if (lchild+1<=maxi && A[lchild]>A[lchild-1])
+        m = lchild+1;
+      for (g=llchild;g<=maxi;g++) {
+        if (A[g-1]>A[m-1])
+          m = g;
       }
-      __trickle_down_max(A,B,m,maxi);
+      __MMHEAP_STAT(compares,(lchild+1<=maxi)+(maxi>=llchild ? maxi-llchild+1 : 0));
     }
-  } else {
-    // m is child
-    if (A[m-1]>A[i-1]) {
-      __ab_swap(A,B,i-1,m-1);
+    // at this point m is the index of the maximum-value child or grandchild
+    __MMHEAP_STAT(compares,1);
+    if (!(A[m-1]>A[i-1]))
+      return;
+    __ab_swap(A,B,i-1,m-1);
+    __MMHEAP_STAT_STEP(trickle_steps,trickle_max);
+    if (m<llchild)
+      return;  // m is a child (and a leaf)
+    int parentm = m >> 1;
+    __MMHEAP_STAT(compares,1);
+    if (A[m-1]<A[parentm-1]) {
+      __ab_swap(A,B,m-1,parentm-1);
+      __MMHEAP_STAT(swaps,1);
     }
+    i = m;
   }
 }
 
 static void __trickle_down(double *A,int *B,int i,int maxi) {
+  __MMHEAP_STAT_CALL(trickle_downs);
   if (isminlevel(i)) {
     __trickle_down_min(A,B,i,maxi);
   } else {
@@ -298,7 +379,7 @@ static double mmheap_peekmin_value(minmaxheap *mmheap) {
 }
 
 static int mmheap_peekmin_index(minmaxheap *mmheap) {
-  if (mmheap->length==0) {
+  if (mmheap->length==0 || mmheap->index==NULL) {
     return NAI;
   }
   return mmheap->index[0];
@@ -323,7 +404,7 @@ static double mmheap_peekmax_value(minmaxheap *mmheap) {
 }
 
 static int mmheap_peekmax_index(minmaxheap *mmheap) {
-  if (mmheap->length==0) {
+  if (mmheap->length==0 || mmheap->index==NULL) {
     return NAI;
   }
   if (mmheap->length==1) {
@@ -340,19 +421,101 @@ static int mmheap_peekmax_index(minmaxheap *mmheap) {
   }
 }
 
+// Threshold prefilter for ksmallest/klargest-type scans.
+// mmheap_scan_below(x,n,t) returns the position of the first x[j]<t
+// and mmheap_scan_above(x,n,t) the first x[j]>t; n if there is none.
+// Compares 8 elements at a time with SSE2/AVX when available.
+
+static int __scan_scalar(const double *x,int n,double t,int above) {
+  int j = 0;
+  if (above) {
+    while (j<n && !(x[j]>t)) j++;
+  } else {
+    while (j<n && !(x[j]<t)) j++;
+  }
+  return j;
+}
+
+#ifdef __CMMHEAP_X86_SIMD
+
+__attribute__((target("sse2")))
+static int __scan_sse2(const double *x,int n,double t,int above) {
+  const __m128d vt = _mm_set1_pd(t);
+  int j = 0;
+  for (;j+8<=n;j+=8) {
+    __m128d a = _mm_loadu_pd(x+j);
+    __m128d b = _mm_loadu_pd(x+j+2);
+    __m128d c = _mm_loadu_pd(x+j+4);
+    __m128d d = _mm_loadu_pd(x+j+6);
+    if (above) {
+      a = _mm_cmpgt_pd(a,vt); b = _mm_cmpgt_pd(b,vt);
+      c = _mm_cmpgt_pd(c,vt); d = _mm_cmpgt_pd(d,vt);
+    } else {
+      a = _mm_cmplt_pd(a,vt); b = _mm_cmplt_pd(b,vt);
+      c = _mm_cmplt_pd(c,vt); d = _mm_cmplt_pd(d,vt);
+    }
+    int m = _mm_movemask_pd(a) | (_mm_movemask_pd(b)<<2) |
+            (_mm_movemask_pd(c)<<4) | (_mm_movemask_pd(d)<<6);
+    if (m)
+      return j+__builtin_ctz(m);
+  }
+  return j+__scan_scalar(x+j,n-j,t,above);
+}
+
+__attribute__((target("avx")))
+static int __scan_avx(const double *x,int n,double t,int above) {
+  const __m256d vt = _mm256_set1_pd(t);
+  int j = 0;
+  for (;j+8<=n;j+=8) {
+    __m256d a = _mm256_loadu_pd(x+j);
+    __m256d b = _mm256_loadu_pd(x+j+4);
+    if (above) {
+      a = _mm256_cmp_pd(a,vt,_CMP_GT_OQ); b = _mm256_cmp_pd(b,vt,_CMP_GT_OQ);
+    } else {
+      a = _mm256_cmp_pd(a,vt,_CMP_LT_OQ); b = _mm256_cmp_pd(b,vt,_CMP_LT_OQ);
+    }
+    int m = _mm256_movemask_pd(a) | (_mm256_movemask_pd(b)<<4);
+    if (m)
+      return j+__builtin_ctz(m);
+  }
+  return j+__scan_scalar(x+j,n-j,t,above);
+}
+
+#endif
+
+static int __scan(const double *x,int n,double t,int above) {
+#ifdef __CMMHEAP_X86_SIMD
+  if (__builtin_cpu_supports("avx"))
+    return __scan_avx(x,n,t,above);
+  if (__builtin_cpu_supports("sse2"))
+    return __scan_sse2(x,n,t,above);
+#endif
+  return __scan_scalar(x,n,t,above);
+}
+
+static int mmheap_scan_below(const double *x,int n,double t) {
+  return __scan(x,n,t,0);
+}
+
+static int mmheap_scan_above(const double *x,int n,double t) {
+  return __scan(x,n,t,1);
+}
+
 // Insert operation; add the pair (v,i) to the heap; O(log n)
 
 static int mmheap_insert(minmaxheap *mmheap,double v,int i) {
   if (mmheap->length==mmheap->maxlength) {
-    return 0;
+    if (!mmheap->growable || !__mmheap_resize(mmheap,2*mmheap->maxlength)) {
+      __MMHEAP_STAT(rejects,1);
+      return 0;
+    }
   }
   double *A = mmheap->value;
   int *B = mmheap->index;
   int j = mmheap->length;
   mmheap->length++;
   
-  A[j] = v;
-  B[j] = i;
+  __ab_set(A,B,j,v,i);
   
   // bubble up uses 1-based indexing
   __bubble_up(A,B,mmheap->length);
@@ -360,6 +523,46 @@ static int mmheap_insert(minmaxheap *mmheap,double v,int i) {
   return 1;
 }
 
+// Bulk build; copy value[0..n) and index[0..n) into the heap and heapify
+// bottom up in O(n). mmheap_assign takes index NULL as indices 0..n-1
+// (index is ignored by a keys-only heap), and returns 0 (heap unchanged) if
+// n is above the capacity of a fixed-size heap or realloc fails.
+// mmheap_create_from makes a keys-only heap of capacity n if index is NULL.
+
+static int mmheap_assign(minmaxheap *mmheap,const double *value,const int *index,int n) {
+  int i,j;
+  if (n<0)
+    n = 0;
+  if (n>mmheap->maxlength) {
+    if (!mmheap->growable)
+      return 0;
+    if (!__mmheap_resize(mmheap,n))  // realloc keeps the heap on failure
+      return 0;
+  }
+  double *A = mmheap->value;
+  int *B = mmheap->index;
+  if (n>0)
+    memcpy((void *)A,(const void *)value,sizeof(double)*n);
+  if (B) {
+    if (index && n>0) {
+      memcpy((void *)B,(const void *)index,sizeof(int)*n);
+    } else {
+      for (j=0;j<n;j++)
+        B[j] = j;
+    }
+  }
+  mmheap->length = n;
+  for (i=n/2;i>=1;i--)
+    __trickle_down(A,B,i,n);
+  return 1;
+}
+
+static minmaxheap *mmheap_create_from(const double *value,const int *index,int n) {
+  minmaxheap *pheap = (index ? mmheap_create(n>0 ? n : 1) : mmheap_create_keys(n>0 ? n : 1));
+  mmheap_assign(pheap,value,index,n);
+  return pheap;
+}
+
 // Remove operations (double-ended); O(log n)
 
 static int mmheap_removemin(minmaxheap *mmheap) {
@@ -370,11 +573,8 @@ static int mmheap_removemin(minmaxheap *mmheap) {
   double *A = mmheap->value;
   int *B = mmheap->index;
   
-  double last_a = A[mmheap->length-1];
-  int last_b = B[mmheap->length-1];
+  __ab_copy(A,B,0,mmheap->length-1);  // reinsert last element at root
   mmheap->length--;            // remove last element
-  A[0] = last_a;
-  B[0] = last_b;              // reinsert at root
   
   __trickle_down(A,B,1,mmheap->length);  // restore heap property
   
@@ -389,9 +589,6 @@ static int mmheap_removemax(minmaxheap *mmheap) {
   double *A = mmheap->value;
   int *B = mmheap->index;
   
-  double last_a = A[mmheap->length-1];
-  int last_b = B[mmheap->length-1];
-  
   int iins;
   
   if (mmheap->length==1) {
@@ -407,13 +604,425 @@ static int mmheap_removemax(minmaxheap *mmheap) {
     }
   }
   
+  __ab_copy(A,B,iins-1,mmheap->length-1);  // reinsert at position where the max was previously
   mmheap->length--;    // remove last element
-  A[iins-1] = last_a;    // reinsert at position where the max was previously
-  B[iins-1] = last_b;
   
   __trickle_down(A,B,iins,mmheap->length);  // restore heap property
   
   return 1;
 }
 
+// Sorted extraction straight into value and index (either may be NULL).
+// mmheap_popmin_n/mmheap_popmax_n remove up to n elements in ascending/
+// descending order and return the number written; the drains empty the heap.
+
+static int mmheap_popmin_n(minmaxheap *mmheap,int n,double *value,int *index) {
+  int j;
+  if (n>mmheap->length)
+    n = mmheap->length;
+  if (n<0)
+    n = 0;
+  double *A = mmheap->value;
+  int *B = mmheap->index;
+  for (j=0;j<n;j++) {
+    if (value) value[j] = A[0];
+    if (index) index[j] = (B ? B[0] : NAI);
+    __ab_copy(A,B,0,mmheap->length-1);
+    mmheap->length--;
+    __trickle_down(A,B,1,mmheap->length);
+  }
+  return n;
+}
+
+static int mmheap_popmax_n(minmaxheap *mmheap,int n,double *value,int *index) {
+  int j,len,iins;
+  if (n>mmheap->length)
+    n = mmheap->length;
+  if (n<0)
+    n = 0;
+  double *A = mmheap->value;
+  int *B = mmheap->index;
+  for (j=0;j<n;j++) {
+    len = mmheap->length;
+    iins = (len<=2 ? len : (A[1]>=A[2] ? 2 : 3));
+    if (value) value[j] = A[iins-1];
+    if (index) index[j] = (B ? B[iins-1] : NAI);
+    __ab_copy(A,B,iins-1,len-1);
+    mmheap->length--;
+    __trickle_down(A,B,iins,mmheap->length);
+  }
+  return n;
+}
+
+static int mmheap_drain_ascending(minmaxheap *mmheap,double *value,int *index) {
+  return mmheap_popmin_n(mmheap,mmheap->length,value,index);
+}
+
+static int mmheap_drain_descending(minmaxheap *mmheap,double *value,int *index) {
+  return mmheap_popmax_n(mmheap,mmheap->length,value,index);
+}
+
+// Replace operations (push-pop); same result as removemin/removemax
+// followed by insert of (v,i), but with a single trickle down; O(log n)
+
+static int mmheap_replacemin(minmaxheap *mmheap,double v,int i) {
+  // overwrite the root then trickle down
+  if (mmheap->length==0)
+    return 0;
+  __MMHEAP_STAT(evictions,1);
+  
+  __ab_set(mmheap->value,mmheap->index,0,v,i);
+  
+  __trickle_down(mmheap->value,mmheap->index,1,mmheap->length);
+  
+  return 1;
+}
+
+static int mmheap_replacemax(minmaxheap *mmheap,double v,int i) {
+  // overwrite the max position then trickle down
+  if (mmheap->length==0)
+    return 0;
+  __MMHEAP_STAT(evictions,1);
+    
+  double *A = mmheap->value;
+  int *B = mmheap->index;
+  
+  int iins;
+  
+  if (mmheap->length<=2) {
+    iins = mmheap->length;
+  } else {
+    iins = (A[1]>=A[2] ? 2 : 3);
+  }
+  
+  if (iins!=1)
+    __MMHEAP_STAT(compares,1);
+  if (iins!=1 && v<A[0]) {
+    // v is a new min; it becomes the root and the old min takes the max position
+    __ab_copy(A,B,iins-1,0);
+    __ab_set(A,B,0,v,i);
+  } else {
+    __ab_set(A,B,iins-1,v,i);
+  }
+  
+  __trickle_down(A,B,iins,mmheap->length);
+  
+  return 1;
+}
+
+// Bounded insert; same as mmheap_insert while the heap is not full.
+// When full, insert_or_evictmax keeps the smallest elements: (v,i) replaces
+// the max if v is below it. insert_or_evictmin keeps the largest elements.
+// Returns 1 if an element left the heap (the old extreme, or (v,i) itself if
+// not admitted) and writes it to *ev,*ei (unless NULL); 0 otherwise.
+
+static int mmheap_insert_or_evictmax(minmaxheap *mmheap,double v,int i,double *ev,int *ei) {
+  if (mmheap->length!=mmheap->maxlength) {
+    mmheap_insert(mmheap,v,i);
+    return 0;
+  }
+  double maxv = mmheap_peekmax_value(mmheap);
+  __MMHEAP_STAT(compares,1);
+  if (v<maxv) {
+    if (ev) *ev = maxv;
+    if (ei) *ei = mmheap_peekmax_index(mmheap);
+    mmheap_replacemax(mmheap,v,i);
+  } else {
+    __MMHEAP_STAT(rejects,1);
+    if (ev) *ev = v;
+    if (ei) *ei = i;
+  }
+  return 1;
+}
+
+static int mmheap_insert_or_evictmin(minmaxheap *mmheap,double v,int i,double *ev,int *ei) {
+  if (mmheap->length!=mmheap->maxlength) {
+    mmheap_insert(mmheap,v,i);
+    return 0;
+  }
+  double minv = mmheap_peekmin_value(mmheap);
+  __MMHEAP_STAT(compares,1);
+  if (v>minv) {
+    if (ev) *ev = minv;
+    if (ei) *ei = mmheap_peekmin_index(mmheap);
+    mmheap_replacemin(mmheap,v,i);
+  } else {
+    __MMHEAP_STAT(rejects,1);
+    if (ev) *ev = v;
+    if (ei) *ei = i;
+  }
+  return 1;
+}
+
+// Merge operations. mmheap_merge adds all elements of src to dst; it returns
+// 0 (dst unchanged) if they do not fit in a fixed-size dst. A small src is
+// inserted element by element, otherwise it is appended and dst is rebuilt
+// bottom up in O(n+m). mmheap_merge_bounded keeps the k smallest (largest==0)
+// or k largest elements of dst and src; both are walked depth-first, and once
+// k elements are kept every subtree rooted at a min-level (max-level) element
+// that cannot make it is skipped. It returns 0 (dst unchanged) if k is above the capacity of a
+// fixed-size dst. src must not be dst.
+
+static int mmheap_merge(minmaxheap *dst,const minmaxheap *src) {
+  int i,j;
+  int n = dst->length+src->length;
+  if (n>dst->maxlength) {
+    if (!dst->growable || !__mmheap_resize(dst,n))
+      return 0;
+  }
+  if (4*src->length<dst->length) {
+    for (j=0;j<src->length;j++)
+      mmheap_insert(dst,src->value[j],src->index ? src->index[j] : NAI);
+    return 1;
+  }
+  double *A = dst->value;
+  int *B = dst->index;
+  for (j=0;j<src->length;j++)
+    __ab_set(A,B,dst->length+j,src->value[j],src->index ? src->index[j] : NAI);
+  dst->length = n;
+  for (i=n/2;i>=1;i--)
+    __trickle_down(A,B,i,n);
+  return 1;
+}
+
+static void __mmheap_admit_bounded(minmaxheap *dst,const minmaxheap *src,int k,int largest) {
+  if (k==0 || src->length==0)
+    return;
+  int st[64];  // DFS stack over 1-based src positions
+  int top = 0;
+  st[top++] = 1;
+  while (top>0) {
+    int p = st[--top];
+    double v = src->value[p-1];
+    int i = (src->index ? src->index[p-1] : NAI);
+    if (dst->length<k) {
+      mmheap_insert(dst,v,i);
+    } else if (!largest) {
+      if (v<mmheap_peekmax_value(dst))
+        mmheap_replacemax(dst,v,i);
+      else if (isminlevel(p))
+        continue;  // nothing below p is smaller
+    } else {
+      if (v>mmheap_peekmin_value(dst))
+        mmheap_replacemin(dst,v,i);
+      else if (!isminlevel(p))
+        continue;  // nothing below p is larger
+    }
+    if (2*p+1<=src->length)
+      st[top++] = 2*p+1;
+    if (2*p<=src->length)
+      st[top++] = 2*p;
+  }
+}
+
+static int mmheap_merge_bounded(minmaxheap *dst,const minmaxheap *src,int k,int largest) {
+  if (k<0)
+    k = 0;
+  if (k>dst->maxlength) {
+    if (!dst->growable || !__mmheap_resize(dst,k))
+      return 0;
+  }
+  if (dst->length>k) {
+    // best k of dst into a scratch heap, then back
+    minmaxheap *tmp = (dst->index ? mmheap_create(k>0 ? k : 1) : mmheap_create_keys(k>0 ? k : 1));
+    __mmheap_admit_bounded(tmp,dst,k,largest);
+    memcpy((void *)dst->value,(const void *)tmp->value,sizeof(double)*tmp->length);
+    if (dst->index)
+      memcpy((void *)dst->index,(const void *)tmp->index,sizeof(int)*tmp->length);
+    dst->length = tmp->length;
+    mmheap_destroy(tmp);
+  }
+  __mmheap_admit_bounded(dst,src,k,largest);
+  return 1;
+}
+
+// Snapshots, in the format of MinMaxHeap<double,int>::Save() in mmheap.h:
+// a 64-byte header, then value[0..length) and index[0..length) in heap order,
+// each zero-padded to a multiple of 64 bytes (no index section for keys-only
+// heaps), with a checksum over header bytes [0,24) and the sections as 64-bit
+// words. mmheap_save returns 0 on I/O error. mmheap_load returns a new heap
+// with the saved capacity (at least 1) and growable flag, or NULL on I/O error
+// or if the file is not a double/int (or keys-only double) snapshot or fails
+// the checksum; a snapshot of a d-ary heap is rebuilt in O(n).
+
+#define __MMHEAP_SNAPSHOT_MAGIC 0x50484d4du  // "MMHP"
+
+typedef struct {
+  unsigned int magic;
+  unsigned short version;
+  unsigned char arity;
+  unsigned char flags;      // 1: keys are layout codes (Packed); 2: growable
+  unsigned short vsize;
+  unsigned short isize;     // 0: keys-only
+  unsigned char vkind;      // 1 floating point, 2 signed integer
+  unsigned char ikind;
+  unsigned short reserved0;
+  int length;
+  int maxlength;
+  unsigned long long checksum;
+  unsigned char reserved[32];
+} __mmheap_snapshot_header;
+
+static size_t __mmheap_pad64(size_t n) {
+  return (n+63)&~(size_t)63;
+}
+
+// FNV-1a over the 64-bit words of p[0..n) zero-padded to padded bytes (a multiple of 8)
+static unsigned long long __mmheap_checksum(unsigned long long h,const void *p,size_t n,size_t padded) {
+  const unsigned char *c = (const unsigned char *) p;
+  unsigned long long w;
+  size_t m = 0;
+  for (;m+8<=n;m+=8) {
+    memcpy(&w,c+m,8);
+    h = (h^w)*0x100000001b3ULL;
+  }
+  for (;m<padded;m+=8) {
+    unsigned char t[8] = {0};
+    if (m<n)
+      memcpy(t,c+m,n-m);
+    memcpy(&w,t,8);
+    h = (h^w)*0x100000001b3ULL;
+  }
+  return h;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>  // fsync
+#define __CMMHEAP_FSYNC(f) fsync(fileno(f))
+#else
+#define __CMMHEAP_FSYNC(f) 0
+#endif
+
+static int __mmheap_write_padded(FILE *f,const void *p,size_t n) {
+  static const unsigned char zero[64] = {0};
+  size_t pad = __mmheap_pad64(n)-n;
+  if (n>0 && fwrite(p,1,n,f)!=n)
+    return 0;
+  return (pad==0 || fwrite(zero,1,pad,f)==pad);
+}
+
+static int __mmheap_read_padded(FILE *f,void *p,size_t n) {
+  unsigned char pad[64];
+  size_t m = __mmheap_pad64(n)-n;
+  if (n>0 && fread(p,1,n,f)!=n)
+    return 0;
+  return (m==0 || fread(pad,1,m,f)==m);
+}
+
+// mmheap_save writes path.tmp, syncs it and renames it over path, so a
+// failed save leaves any previous snapshot in place. mmheap_load checks the
+// file size and the checksum before it allocates the heap; NULL on any
+// mismatch or when out of memory.
+
+static int mmheap_save(const minmaxheap *mmheap,const char *path) {
+  __mmheap_snapshot_header h;
+  size_t nv = sizeof(double)*mmheap->length;
+  size_t ni = (mmheap->index ? sizeof(int)*mmheap->length : 0);
+  size_t m = strlen(path);
+  char *tmp;
+  FILE *f;
+  int ok;
+  memset(&h,0,sizeof(h));
+  h.magic = __MMHEAP_SNAPSHOT_MAGIC;
+  h.version = 1;
+  h.arity = 2;
+  h.flags = (mmheap->growable ? 2 : 0);
+  h.vsize = sizeof(double);
+  h.vkind = 1;
+  if (mmheap->index) {
+    h.isize = sizeof(int);
+    h.ikind = 2;
+  }
+  h.length = mmheap->length;
+  h.maxlength = mmheap->maxlength;
+  h.checksum = __mmheap_checksum(0xcbf29ce484222325ULL,&h,24,24);
+  h.checksum = __mmheap_checksum(h.checksum,mmheap->value,nv,__mmheap_pad64(nv));
+  if (mmheap->index)
+    h.checksum = __mmheap_checksum(h.checksum,mmheap->index,ni,__mmheap_pad64(ni));
+  tmp = (char *) malloc(m+5);
+  if (tmp==NULL)
+    return 0;
+  memcpy(tmp,path,m);
+  memcpy(tmp+m,".tmp",5);
+  f = fopen(tmp,"wb");
+  if (f==NULL) {
+    free(tmp);
+    return 0;
+  }
+  ok = (fwrite(&h,sizeof(h),1,f)==1
+        && __mmheap_write_padded(f,mmheap->value,nv)
+        && (mmheap->index==NULL || __mmheap_write_padded(f,mmheap->index,ni))
+        && fflush(f)==0 && __CMMHEAP_FSYNC(f)==0);
+  ok = (fclose(f)==0 && ok);
+  ok = (ok && rename(tmp,path)==0);
+  if (!ok)
+    remove(tmp);
+  free(tmp);
+  return ok;
+}
+
+static minmaxheap *mmheap_load(const char *path) {
+  __mmheap_snapshot_header h;
+  double *value = NULL;
+  int *index = NULL;
+  minmaxheap *pheap = NULL;
+  size_t nv = 0,ni = 0;
+  long size;
+  int i,m,ok;
+  FILE *f = fopen(path,"rb");
+  if (f==NULL)
+    return NULL;
+  ok = (fread(&h,sizeof(h),1,f)==1
+        && h.magic==__MMHEAP_SNAPSHOT_MAGIC && h.version==1
+        && h.vsize==sizeof(double) && h.vkind==1
+        && ((h.isize==sizeof(int) && h.ikind==2) || (h.isize==0 && h.ikind==0))
+        && h.length>=0 && h.maxlength>=h.length);
+  if (ok) {
+    // the sections must fill the rest of the file, so length is bounded by the file size
+    nv = sizeof(double)*(size_t)h.length;
+    ni = (h.isize ? sizeof(int)*(size_t)h.length : 0);
+    ok = (fseek(f,0,SEEK_END)==0 && (size = ftell(f))>=0
+          && (size_t)size==sizeof(h)+__mmheap_pad64(nv)+__mmheap_pad64(ni)
+          && fseek(f,(long)sizeof(h),SEEK_SET)==0);
+  }
+  if (ok) {
+    value = (double *) malloc(nv+1);
+    index = (h.isize ? (int *) malloc(ni+1) : NULL);
+    ok = (value!=NULL && (h.isize==0 || index!=NULL)
+          && __mmheap_read_padded(f,value,nv)
+          && (index==NULL || __mmheap_read_padded(f,index,ni)));
+  }
+  fclose(f);
+  if (ok) {
+    // the checksum covers the header, maxlength included
+    unsigned long long c = __mmheap_checksum(0xcbf29ce484222325ULL,&h,24,24);
+    c = __mmheap_checksum(c,value,nv,__mmheap_pad64(nv));
+    if (index)
+      c = __mmheap_checksum(c,index,ni,__mmheap_pad64(ni));
+    ok = (c==h.checksum);
+  }
+  if (ok) {
+    m = (h.maxlength>0 ? h.maxlength : 1);  // a saved capacity-0 heap comes back with room for 1
+    pheap = (h.isize ? mmheap_create(m) : mmheap_create_keys(m));
+    if (pheap!=NULL && (pheap->value==NULL || (h.isize && pheap->index==NULL))) {
+      mmheap_destroy(pheap);
+      pheap = NULL;
+    }
+  }
+  if (pheap!=NULL) {
+    memcpy(pheap->value,value,nv);
+    if (index)
+      memcpy(pheap->index,index,ni);
+    pheap->length = h.length;
+    pheap->growable = ((h.flags&2)!=0);
+    if (h.arity!=2 || (h.flags&1)) {
+      for (i=h.length/2;i>=1;i--)
+        __trickle_down(pheap->value,pheap->index,i,h.length);
+    }
+  }
+  free(value);
+  free(index);
+  return pheap;
+}
+
 #endif
@@ -4,6 +4,15 @@
  * Basic interface to clock_gettime() <time.h>
  * to get nanosecond resolution timing (supposedly).
  *
+ * The fclk_counters_* functions add a group of hardware counters (Linux
+ * perf_event_open) around a timed region; without them (other systems,
+ * perf_event_paranoid, containers, or -DFCLK_NO_PERF) a region reports
+ * elapsed time only.
+ *
+ * fclk_ticks() reads the CPU time stamp counter, cheap enough to time a
+ * single heap operation, and fclk_histogram collects such latencies in
+ * log-linear buckets for percentiles.
+ *
  */
  
 #ifndef __FASTCLOCK_H__
@@ -37,5 +46,310 @@ static inline double fclk_delta_timestamps__(
   return fclk_delta_timestamps(ptm1, ptm2);
 }
 
+/*
+ * Hardware counters of the calling thread (user space only), opened as
+ * one group so that they count over the same instructions:
+ *
+ *   fclk_counters pc;
+ *   fclk_counters_open(&pc);   // number of counters available, maybe 0
+ *   fclk_counters_start(&pc);
+ *   ... region ...
+ *   fclk_counters_stop(&pc);   // pc.elapsed [sec], pc.value[], pc.valid[]
+ *   fclk_counters_close(&pc);
+ *
+ * Counters the hardware or kernel does not provide are left out of the
+ * group (valid[c]==0); values are scaled up if the kernel had to
+ * multiplex the group.
+ */
+
+#if defined(__linux__) && !defined(FCLK_NO_PERF)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <string.h>
+#include <unistd.h>
+#define __FCLK_PERF
+#endif
+
+enum { FCLK_CYCLES, FCLK_INSTRUCTIONS, FCLK_BRANCH_MISSES, FCLK_L1D_MISSES, FCLK_LLC_MISSES, FCLK_NCOUNTERS };
+
+typedef struct {
+  int fd[FCLK_NCOUNTERS];    // -1 if not available; the first open one leads the group
+  int leader;
+  int nopen;
+  fclk_timespec tic, toc;
+  double elapsed;
+  unsigned long long value[FCLK_NCOUNTERS];
+  int valid[FCLK_NCOUNTERS];
+} fclk_counters;
+
+#ifdef __FCLK_PERF
+static inline int __fclk_perf_open(unsigned int type, unsigned long long config, int group) {
+  struct perf_event_attr a;
+  memset(&a, 0, sizeof(a));
+  a.size = sizeof(a);
+  a.type = type;
+  a.config = config;
+  a.disabled = (group==-1);
+  a.exclude_kernel = 1;
+  a.exclude_hv = 1;
+  a.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return (int) syscall(__NR_perf_event_open, &a, 0, -1, group, 0);
+}
+#endif
+
+static inline int fclk_counters_open(fclk_counters *pc) {
+  int c;
+  pc->leader = -1;
+  pc->nopen = 0;
+  pc->elapsed = 0.0;
+  for (c=0; c<FCLK_NCOUNTERS; c++) {
+    pc->fd[c] = -1;
+    pc->value[c] = 0;
+    pc->valid[c] = 0;
+  }
+#ifdef __FCLK_PERF
+  const unsigned int type[FCLK_NCOUNTERS] = {
+    PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE };
+  const unsigned long long config[FCLK_NCOUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES,
+    PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    PERF_COUNT_HW_CACHE_MISSES };
+  for (c=0; c<FCLK_NCOUNTERS; c++) {
+    pc->fd[c] = __fclk_perf_open(type[c], config[c], pc->leader);
+    if (pc->fd[c]<0) continue;
+    if (pc->leader<0) pc->leader = pc->fd[c];
+    pc->nopen++;
+  }
+#endif
+  return pc->nopen;
+}
+
+static inline void fclk_counters_start(fclk_counters *pc) {
+#ifdef __FCLK_PERF
+  if (pc->leader>=0) {
+    ioctl(pc->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(pc->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+#endif
+  fclk_timestamp(&pc->tic);
+}
+
+static inline void fclk_counters_stop(fclk_counters *pc) {
+  int c;
+  fclk_timestamp(&pc->toc);
+  pc->elapsed = fclk_delta_timestamps(&pc->tic, &pc->toc);
+  for (c=0; c<FCLK_NCOUNTERS; c++) {
+    pc->value[c] = 0;
+    pc->valid[c] = 0;
+  }
+#ifdef __FCLK_PERF
+  if (pc->leader<0) return;
+  ioctl(pc->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  // nr, time enabled, time running, then one value per member in the order opened
+  unsigned long long buf[3+FCLK_NCOUNTERS];
+  if (read(pc->leader, buf, sizeof(buf))<(ssize_t)(3*sizeof(unsigned long long)) || buf[2]==0) return;
+  double scale = (double) buf[1]/(double) buf[2];
+  int j = 0;
+  for (c=0; c<FCLK_NCOUNTERS; c++) {
+    if (pc->fd[c]<0) continue;
+    if (j<(int) buf[0]) {
+      pc->value[c] = (unsigned long long) (scale*(double) buf[3+j]);
+      pc->valid[c] = 1;
+    }
+    j++;
+  }
+#endif
+}
+
+static inline void fclk_counters_close(fclk_counters *pc) {
+  int c;
+  for (c=0; c<FCLK_NCOUNTERS; c++) {
+#ifdef __FCLK_PERF
+    if (pc->fd[c]>=0) close(pc->fd[c]);
+#endif
+    pc->fd[c] = -1;
+  }
+  pc->leader = -1;
+  pc->nopen = 0;
+}
+
+/* instructions per cycle, and counter c per element over n elements;
+   both -1 if not counted */
+
+static inline double fclk_counters_ipc(const fclk_counters *pc) {
+  if (!pc->valid[FCLK_CYCLES] || !pc->valid[FCLK_INSTRUCTIONS] || pc->value[FCLK_CYCLES]==0) return -1.0;
+  return (double) pc->value[FCLK_INSTRUCTIONS]/(double) pc->value[FCLK_CYCLES];
+}
+
+static inline double fclk_counters_per(const fclk_counters *pc, int c, double n) {
+  if (!pc->valid[c] || n<=0.0) return -1.0;
+  return (double) pc->value[c]/n;
+}
+
+/*
+ * Tick timer: fclk_ticks() / fclk_ticks_end() read the time stamp counter
+ * (rdtsc / rdtscp on x86, cntvct_el0 on aarch64; clock_gettime ns on
+ * other targets) at the start / end of a timed interval, fenced so that
+ * the interval covers exactly the instructions in between. Ticks convert
+ * to ns with the rate from fclk_ticks_calibrate(), which measures it
+ * against CLOCK_MONOTONIC over about 20 ms; call it once at startup (the
+ * conversion calibrates on first use otherwise). This assumes a constant
+ * rate, invariant TSC, as on all current x86 and aarch64 servers.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define __FCLK_TSC
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define __FCLK_CNTVCT
+#endif
+
+static inline unsigned long long fclk_ticks(void) {
+#if defined(__FCLK_TSC)
+  _mm_lfence();  // earlier instructions finish first
+  return __rdtsc();
+#elif defined(__FCLK_CNTVCT)
+  unsigned long long t;
+  __asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r" (t) :: "memory");
+  return t;
+#else
+  fclk_timespec tm;
+  fclk_timestamp(&tm);
+  return (unsigned long long) tm.tv_sec*1000000000ull+(unsigned long long) tm.tv_nsec;
+#endif
+}
+
+static inline unsigned long long fclk_ticks_end(void) {
+#if defined(__FCLK_TSC)
+  unsigned int aux;
+  unsigned long long t = __rdtscp(&aux);  // waits for earlier instructions
+  _mm_lfence();  // later instructions start after the read
+  return t;
+#else
+  return fclk_ticks();
+#endif
+}
+
+static double __fclk_ns_per_tick = 0.0;
+
+static inline double fclk_ticks_calibrate(void) {
+  fclk_timespec tm0, tm1;
+  unsigned long long t0, t1;
+  fclk_timestamp(&tm0);
+  t0 = fclk_ticks();
+  do {
+    fclk_timestamp(&tm1);
+    t1 = fclk_ticks_end();
+  } while (fclk_delta_timestamps(&tm0, &tm1)<0.02);
+  __fclk_ns_per_tick = (t1>t0) ? 1.0e9*fclk_delta_timestamps(&tm0, &tm1)/(double) (t1-t0) : 1.0;
+  return __fclk_ns_per_tick;
+}
+
+static inline double fclk_ticks_to_ns(double ticks) {
+  if (__fclk_ns_per_tick==0.0) fclk_ticks_calibrate();
+  return ticks*__fclk_ns_per_tick;
+}
+
+/* smallest interval fclk_ticks() .. fclk_ticks_end() can report, in ticks;
+   subtract it from short intervals */
+
+static inline unsigned long long fclk_ticks_overhead(void) {
+  unsigned long long m = ~0ull;
+  int r;
+  for (r=0; r<1000; r++) {
+    unsigned long long t0 = fclk_ticks();
+    unsigned long long t1 = fclk_ticks_end();
+    if (t1-t0<m) m = t1-t0;
+  }
+  return m;
+}
+
+/*
+ * HDR-style latency histogram: values (ticks, ns, any unit) below 2^B go
+ * into exact buckets, larger ones into 2^B buckets per power of two, so
+ * every value is kept to within 1/2^B (about 3% for B = 5) over the full
+ * 64-bit range, in fixed memory and with an O(1) add.
+ *
+ *   fclk_histogram h;
+ *   fclk_histogram_clear(&h);
+ *   fclk_histogram_add(&h, t1-t0);
+ *   fclk_histogram_percentile(&h, 99.9);  // a value at least 99.9% of the adds are below
+ */
+
+#define FCLK_HIST_BITS 5
+#define FCLK_HIST_BUCKETS ((64-FCLK_HIST_BITS+1)<<FCLK_HIST_BITS)
+
+typedef struct {
+  unsigned long long count[FCLK_HIST_BUCKETS];
+  unsigned long long n;
+  unsigned long long min;
+  unsigned long long max;
+  double sum;
+} fclk_histogram;
+
+static inline void fclk_histogram_clear(fclk_histogram *ph) {
+  int b;
+  for (b=0; b<FCLK_HIST_BUCKETS; b++) ph->count[b] = 0;
+  ph->n = 0;
+  ph->min = ~0ull;
+  ph->max = 0;
+  ph->sum = 0.0;
+}
+
+static inline int __fclk_histogram_bucket(unsigned long long v) {
+  if (v<(1ull<<FCLK_HIST_BITS)) return (int) v;
+#if defined(__GNUC__)
+  int m = 63-__builtin_clzll(v);  // msb, >= FCLK_HIST_BITS
+#else
+  int m = FCLK_HIST_BITS;
+  while (v>>(m+1)) m++;
+#endif
+  int shift = m-FCLK_HIST_BITS;
+  return ((shift+1)<<FCLK_HIST_BITS)+(int) ((v>>shift)-(1ull<<FCLK_HIST_BITS));
+}
+
+// largest value that falls in bucket b
+static inline unsigned long long __fclk_histogram_top(int b) {
+  if (b<(1<<FCLK_HIST_BITS)) return (unsigned long long) b;
+  int shift = (b>>FCLK_HIST_BITS)-1;
+  unsigned long long lo = ((1ull<<FCLK_HIST_BITS)+(unsigned long long) (b&((1<<FCLK_HIST_BITS)-1)))<<shift;
+  return lo+((1ull<<shift)-1);
+}
+
+static inline void fclk_histogram_add(fclk_histogram *ph, unsigned long long v) {
+  ph->count[__fclk_histogram_bucket(v)]++;
+  ph->n++;
+  if (v<ph->min) ph->min = v;
+  if (v>ph->max) ph->max = v;
+  ph->sum += (double) v;
+}
+
+static inline double fclk_histogram_mean(const fclk_histogram *ph) {
+  return (ph->n>0) ? ph->sum/(double) ph->n : 0.0;
+}
+
+/* q in [0, 100]: the top of the bucket holding the ceil(q/100 n)-th
+   smallest value, capped by the max; 0 if empty */
+
+static inline unsigned long long fclk_histogram_percentile(const fclk_histogram *ph, double q) {
+  if (ph->n==0) return 0;
+  double r = q/100.0*(double) ph->n;
+  unsigned long long rank = (unsigned long long) r;
+  if ((double) rank<r) rank++;
+  if (rank<1) rank = 1;
+  if (rank>ph->n) rank = ph->n;
+  unsigned long long c = 0;
+  int b;
+  for (b=0; b<FCLK_HIST_BUCKETS; b++) {
+    c += ph->count[b];
+    if (c>=rank) break;
+  }
+  unsigned long long v = __fclk_histogram_top(b);
+  if (v>ph->max) v = ph->max;
+  if (v<ph->min) v = ph->min;
+  return v;
+}
+
 #endif
 
@@ -0,0 +1,283 @@
+/*
+ * fmmheap.h
+ *
+ * Streaming top-k over binary files of raw values (POSIX), for inputs
+ * that do not fit in memory.
+ *
+ * ScanFile() feeds a TopK chunk by chunk, either from read-only mmap
+ * windows of the file (MinMaxHeapFile::Mmap) or from two read() buffers,
+ * where a helper thread fills the next buffer while the current one is
+ * scanned (MinMaxHeapFile::Read). Both paths hint sequential access to
+ * the kernel. Memory stays at O(k) for the heap plus one mapped window
+ * or two buffers of the chunk size.
+ *
+ * The element at byte offset o of the file gets index o / sizeof(V),
+ * counted from the TopK's Count() before the call; use a 64-bit index
+ * type for files of more than 2^31 elements. A trailing partial element
+ * is ignored.
+ *
+ * MappedMinMaxHeap maps a heap snapshot (MinMaxHeap::Save, mmheap_save)
+ * read-only and peeks straight from the mapping, so that a saved heap is
+ * usable without reading or rebuilding it.
+ *
+ */
+
+#ifndef __FMMHEAP_H__
+#define __FMMHEAP_H__
+
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mmheap.h"
+
+namespace MinMaxHeapFile
+{
+
+enum Method { Mmap, Read };
+
+// default bytes per mapped window or read buffer
+const std::size_t DefaultChunk = std::size_t(1) << 24;
+
+}
+
+namespace MinMaxHeapAux
+{
+
+// read up to len bytes, retrying short reads; -1 on error, < len at EOF
+static inline ssize_t __read_full(int fd, void *buf, std::size_t len) {
+  std::size_t got = 0;
+  while (got < len) {
+    ssize_t r = ::read(fd, (char *) buf + got, len - got);
+    if (r == 0) break;
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    got += r;
+  }
+  return (ssize_t) got;
+}
+
+template <class TK, class V>
+static long long __scan_file_mmap(TK& tk, int fd, std::size_t chunk) {
+  struct stat st;
+  if (::fstat(fd, &st) != 0) return -1;
+  // windows must start on a page boundary and hold whole elements, at
+  // most INT_MAX of them (TopK::Scan takes an int count)
+  std::size_t unit = (std::size_t) ::sysconf(_SC_PAGESIZE) * sizeof(V);
+  if (chunk > (std::size_t) INT_MAX * sizeof(V)) chunk = (std::size_t) INT_MAX * sizeof(V);
+  chunk = (chunk < unit) ? unit : chunk - chunk % unit;
+  std::size_t size = (std::size_t) st.st_size;
+  size -= size % sizeof(V);
+  long long n = 0;
+  for (std::size_t off = 0; off < size; off += chunk) {
+    std::size_t len = (size - off < chunk) ? size - off : chunk;
+    void *p = ::mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, (off_t) off);
+    if (p == MAP_FAILED) return -1;
+    ::madvise(p, len, MADV_SEQUENTIAL);
+    tk.Scan((const V *) p, (int) (len / sizeof(V)));
+    ::munmap(p, len);
+    n += len / sizeof(V);
+  }
+  return n;
+}
+
+template <class TK, class V>
+static long long __scan_file_read(TK& tk, int fd, std::size_t chunk) {
+  struct stat st;
+  if (::fstat(fd, &st) != 0) return -1;
+  // no larger than the file (plus one element, to see EOF at once)
+  std::size_t m = (chunk < sizeof(V)) ? 1 : chunk / sizeof(V);
+  if (m > (std::size_t) INT_MAX) m = INT_MAX;  // TopK::Scan takes an int count
+  std::size_t mf = (std::size_t) st.st_size / sizeof(V) + 1;
+  if (S_ISREG(st.st_mode) && mf < m) m = mf;
+  std::size_t bytes = m * sizeof(V);
+#ifdef POSIX_FADV_SEQUENTIAL
+  ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  std::unique_ptr<V[]> buf[2] = { std::unique_ptr<V[]>(new V[m]), std::unique_ptr<V[]>(new V[m]) };
+  ssize_t got[2] = { __read_full(fd, buf[0].get(), bytes), 0 };
+  long long n = 0;
+  int cur = 0;
+  while (got[cur] >= (ssize_t) sizeof(V)) {
+    int nxt = cur ^ 1;
+    std::thread reader;
+    if (got[cur] == (ssize_t) bytes) {
+      reader = std::thread([&buf, &got, fd, bytes, nxt] {
+        got[nxt] = __read_full(fd, buf[nxt].get(), bytes);
+      });
+    }
+    int len = (int) (got[cur] / sizeof(V));
+    tk.Scan(buf[cur].get(), len);
+    n += len;
+    if (!reader.joinable()) return n;
+    reader.join();
+    cur = nxt;
+  }
+  return (got[cur] < 0) ? -1 : n;
+}
+
+}
+
+/* Scan the values stored in file path into tk; returns the number of
+   elements scanned, or -1 if the file cannot be opened, mapped or read
+   (tk then holds the elements scanned before the failure) */
+
+template <class V, class I, class L, int D>
+long long ScanFile(TopK<V, I, L, D>& tk, const char *path,
+                   MinMaxHeapFile::Method method = MinMaxHeapFile::Mmap,
+                   std::size_t chunk = MinMaxHeapFile::DefaultChunk)
+{
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0) return -1;
+  long long n = (method == MinMaxHeapFile::Mmap)
+    ? MinMaxHeapAux::__scan_file_mmap<TopK<V, I, L, D>, V>(tk, fd, chunk)
+    : MinMaxHeapAux::__scan_file_read<TopK<V, I, L, D>, V>(tk, fd, chunk);
+  ::close(fd);
+  return n;
+}
+
+/* File versions of KSmallest()/KLargest(); ik receives element offsets
+   into the file. Returns min(n,k), or -1 on I/O failure. */
+
+template <class V, class I>
+int KSmallestFile(const char *path, int k, V *xk, I *ik,
+                  MinMaxHeapFile::Method method = MinMaxHeapFile::Mmap)
+{
+  TopK<V, I> tk(k, false);
+  if (ScanFile(tk, path, method) < 0) return -1;
+  return tk.Emit(xk, ik);
+}
+
+template <class V, class I>
+int KLargestFile(const char *path, int k, V *xk, I *ik,
+                 MinMaxHeapFile::Method method = MinMaxHeapFile::Mmap)
+{
+  TopK<V, I> tk(k, true);
+  if (ScanFile(tk, path, method) < 0) return -1;
+  return tk.Emit(xk, ik);
+}
+
+/*
+ * MappedMinMaxHeap<V, I, D>: read-only view of a snapshot saved by a
+ * MinMaxHeap<V, I, L, D> with value order (any layout but Packed); the
+ * arrays are used in place, in heap order. MinMaxHeap::Assign(Values(),
+ * Indices(), Length()) or MinMaxHeap::Load make a mutable copy.
+ */
+
+template <class V, class I = void, int D = 2>
+class MappedMinMaxHeap
+{
+  typedef MinMaxHeapAux::__snapshot_type<V> vt;
+  typedef MinMaxHeapAux::__snapshot_type<I> it;
+
+public:
+  MappedMinMaxHeap() : base(nullptr), size(0), value(nullptr), index(nullptr), length(0), maxlength(0) { }
+
+  MappedMinMaxHeap(const MappedMinMaxHeap&) = delete;
+  MappedMinMaxHeap& operator=(const MappedMinMaxHeap&) = delete;
+
+  ~MappedMinMaxHeap() {
+    Unmap();
+  }
+
+  /* False (nothing mapped) if path cannot be mapped or is not a snapshot
+     of this element type and arity; verify checks the checksum, which
+     reads the whole file */
+
+  bool MapReadOnly(const char *path, bool verify = true) {
+    Unmap();
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (::fstat(fd, &st) == 0 && (std::size_t) st.st_size >= sizeof(MinMaxHeapAux::__snapshot_header)) {
+      p = ::mmap(nullptr, (std::size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (p == MAP_FAILED) return false;
+    base = static_cast<const unsigned char *>(p);
+    size = (std::size_t) st.st_size;
+    MinMaxHeapAux::__snapshot_header h;
+    std::memcpy(&h, base, sizeof(h));
+    std::size_t bytes = 0;
+    bool ok = MinMaxHeapAux::__snapshot_check(h, vt::size, vt::kind, it::size, it::kind, &bytes)
+      && size == sizeof(h) + bytes && h.arity == D && (h.flags & 1) == 0;
+    if (ok && verify) {
+      MinMaxHeapAux::__checksum c;
+      c.add(&h, 24);
+      c.add(base + sizeof(h), bytes);
+      ok = (c.value() == h.checksum);
+    }
+    if (!ok) {
+      Unmap();
+      return false;
+    }
+    value = reinterpret_cast<const V *>(base + sizeof(h));
+    index = reinterpret_cast<const I *>(base + sizeof(h) + MinMaxHeapAux::__snapshot_pad((std::size_t) h.length * vt::size));
+    length = h.length;
+    maxlength = h.maxlength;
+    return true;
+  }
+
+  void Unmap() {
+    if (base != nullptr) ::munmap((void *) base, size);
+    base = nullptr;
+    size = 0;
+    value = nullptr;
+    index = nullptr;
+    length = 0;
+    maxlength = 0;
+  }
+
+  bool Mapped() const { return base != nullptr; }
+  int Length() const { return length; }
+  int MaxLength() const { return maxlength; }  // capacity of the saved heap
+
+  const V *Values() const { return value; }
+  const I *Indices() const { return index; }
+
+  /* O(1) peek operations, as for MinMaxHeap */
+
+  bool PeekMinValue(V *v) const { return MinMaxHeapAux::__peek_value<D>(__view(), length, false, v); }
+  bool PeekMaxValue(V *v) const { return MinMaxHeapAux::__peek_value<D>(__view(), length, true, v); }
+
+  bool PeekMinIndex(I *i) const {
+    static_assert(!std::is_void<I>::value, "keys-only heap has no index");
+    return MinMaxHeapAux::__peek_index<D>(__view(), length, false, i);
+  }
+
+  bool PeekMaxIndex(I *i) const {
+    static_assert(!std::is_void<I>::value, "keys-only heap has no index");
+    return MinMaxHeapAux::__peek_index<D>(__view(), length, true, i);
+  }
+
+private:
+  // read-only store over the mapped arrays (1-based positions), for the
+  // peeks shared with MinMaxHeap
+  struct store {
+    const V *value;
+    const I *index;
+    const V& key(int p) const { return value[p - 1]; }
+    V value_at(int p) const { return value[p - 1]; }
+    I index_at(int p) const { return index[p - 1]; }
+  };
+
+  store __view() const { return store{value, index}; }
+
+  const unsigned char *base;
+  std::size_t size;
+  const V *value;
+  const I *index;
+  int length;
+  int maxlength;
+};
+
+#endif
@@ -0,0 +1,470 @@
+/*
+ * Benchmark suite for k-smallest selection with the min-max-heap
+ * (mmheap.h and cmmheap.h) against standard alternatives.
+ *
+ * Sweeps n = 10^3 .. maxn and k = 1 .. n/10 (powers of 10), value type
+ * and input distribution. Every configuration runs repeated trials of
+ * each method on the same input (generated from a fixed seed), checks
+ * each result against std::nth_element, and writes one CSV row per
+ * method with the min, percentiles and max of the trial times to stdout.
+ * Where the hardware counters of fastclock.h are available, the rows also
+ * carry the IPC and the branch, L1D and LLC misses per element over all
+ * trials; those columns are empty otherwise.
+ *
+ * Methods (all return the k smallest values in ascending order with
+ * their positions in the input):
+ *   mmheap          MinMaxHeap<V, int>, PeekMaxValue + ReplaceMax loop
+ *   topk            TopK<V, int> scan (SIMD prefilter for double/float)
+ *   cmmheap         C heap with mmheap_scan_below (double only)
+ *   priority_queue  std::priority_queue of (value, index), max on top
+ *   nth_element     std::nth_element on a copy, then sort of the first k
+ *   partial_sort    std::partial_sort on a copy
+ *
+ * Distributions:
+ *   uniform     uniform random
+ *   sorted      ascending; nothing after the first k is admitted
+ *   reverse     descending; every element is admitted
+ *   duplicates  16 distinct values
+ *   zigzag      a descending stream interleaved with an ascending one;
+ *               every other element is admitted, which defeats both the
+ *               branch predictor and the blockwise threshold prefilter
+ *
+ * With -l, per-operation latency instead: Insert, ReplaceMax, RemoveMin
+ * and RemoveMax on heaps of k = 10 .. maxn/10 elements, each call timed
+ * with the tick timer (less its own overhead) into a log-bucketed
+ * histogram, one row per (type, heap, k, op) with the mean, p50, p99,
+ * p99.9 and max in ns. Every op is timed at least max(trials * k, 10^5)
+ * times.
+ *
+ * USAGE: ./mmheap-bench [-t trials] [-n maxn] [-s seed] [-l] > results.csv
+ *
+ */
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <queue>
+#include <string>
+#include <utility>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <cmath>
+#include <unistd.h>
+#include "fastclock.h"
+#include "mmheap.h"
+#include "cmmheap.h"
+
+template <class V>
+struct value_traits;
+
+template <>
+struct value_traits<double> {
+  static const char *name() { return "double"; }
+  static double uniform(std::mt19937_64& g) { return std::uniform_real_distribution<double>(0.0, 1.0)(g); }
+};
+
+template <>
+struct value_traits<float> {
+  static const char *name() { return "float"; }
+  static float uniform(std::mt19937_64& g) { return std::uniform_real_distribution<float>(0.0f, 1.0f)(g); }
+};
+
+template <>
+struct value_traits<std::int32_t> {
+  static const char *name() { return "int32"; }
+  static std::int32_t uniform(std::mt19937_64& g) { return (std::int32_t) (g() >> 32); }
+};
+
+template <>
+struct value_traits<std::int64_t> {
+  static const char *name() { return "int64"; }
+  static std::int64_t uniform(std::mt19937_64& g) { return (std::int64_t) g(); }
+};
+
+const char *dists[] = { "uniform", "sorted", "reverse", "duplicates", "zigzag" };
+const int ndists = sizeof(dists) / sizeof(dists[0]);
+
+template <class V>
+std::vector<V> make_input(int dist, int n, std::mt19937_64& g)
+{
+  std::vector<V> x(n);
+  for (int i = 0; i < n; i++) x[i] = value_traits<V>::uniform(g);
+  switch (dist) {
+  case 1:
+    std::sort(x.begin(), x.end());
+    break;
+  case 2:
+    std::sort(x.begin(), x.end());
+    std::reverse(x.begin(), x.end());
+    break;
+  case 3: {
+    std::vector<V> levels(x.begin(), x.begin() + (n < 16 ? n : 16));
+    for (int i = 0; i < n; i++) x[i] = levels[g() % levels.size()];
+    break;
+  }
+  case 4: {
+    // the lower half descending at even positions, the upper half ascending at odd ones
+    std::vector<V> s(x);
+    std::sort(s.begin(), s.end());
+    int h = (n + 1) / 2;
+    for (int i = 0; i < n; i++) x[i] = (i & 1) ? s[h + i / 2] : s[h - 1 - i / 2];
+    break;
+  }
+  }
+  return x;
+}
+
+/* Methods: k smallest of x into xk (ascending) and ik; return the count */
+
+template <class V>
+int run_mmheap(const std::vector<V>& x, int k, V *xk, int *ik)
+{
+  int n = x.size();
+  MinMaxHeap<V, int> h(k);
+  V t = V();
+  int i;
+  for (i = 0; i < n && i < k; i++) h.Insert(x[i], i);
+  h.PeekMaxValue(&t);
+  for (; i < n; i++) {
+    if (x[i] < t) {
+      h.ReplaceMax(x[i], i);
+      h.PeekMaxValue(&t);
+    }
+  }
+  return h.DrainAscending(xk, ik);
+}
+
+template <class V>
+int run_topk(const std::vector<V>& x, int k, V *xk, int *ik)
+{
+  TopK<V, int> tk(k, false);
+  tk.Scan(x.data(), (int) x.size());
+  return tk.Emit(xk, ik);
+}
+
+template <class V>
+int run_cmmheap(const std::vector<V>&, int, V *, int *)
+{
+  return -1;  // C heap is double/int only
+}
+
+template <>
+int run_cmmheap<double>(const std::vector<double>& x, int k, double *xk, int *ik)
+{
+  int n = x.size();
+  minmaxheap *pheap = mmheap_create(k);
+  int i;
+  for (i = 0; i < n && i < k; i++) mmheap_insert(pheap, x[i], i);
+  while (i < n) {
+    i += mmheap_scan_below(x.data() + i, n - i, mmheap_peekmax_value(pheap));
+    if (i == n) break;
+    mmheap_replacemax(pheap, x[i], i);
+    i++;
+  }
+  i = mmheap_drain_ascending(pheap, xk, ik);
+  mmheap_destroy(pheap);
+  return i;
+}
+
+template <class V>
+int run_priority_queue(const std::vector<V>& x, int k, V *xk, int *ik)
+{
+  int n = x.size();
+  std::priority_queue<std::pair<V, int> > q;
+  for (int i = 0; i < n; i++) {
+    if ((int) q.size() < k) {
+      q.push(std::make_pair(x[i], i));
+    } else if (x[i] < q.top().first) {
+      q.pop();
+      q.push(std::make_pair(x[i], i));
+    }
+  }
+  int m = q.size();
+  for (int j = m - 1; j >= 0; j--) {
+    xk[j] = q.top().first;
+    ik[j] = q.top().second;
+    q.pop();
+  }
+  return m;
+}
+
+template <class V>
+std::vector<std::pair<V, int> > make_pairs(const std::vector<V>& x)
+{
+  std::vector<std::pair<V, int> > p(x.size());
+  for (std::size_t i = 0; i < x.size(); i++) p[i] = std::make_pair(x[i], (int) i);
+  return p;
+}
+
+template <class V>
+int run_nth_element(const std::vector<V>& x, int k, V *xk, int *ik)
+{
+  std::vector<std::pair<V, int> > p = make_pairs(x);
+  int m = (k < (int) p.size()) ? k : p.size();
+  std::nth_element(p.begin(), p.begin() + m - 1, p.end());
+  std::sort(p.begin(), p.begin() + m);
+  for (int j = 0; j < m; j++) {
+    xk[j] = p[j].first;
+    ik[j] = p[j].second;
+  }
+  return m;
+}
+
+template <class V>
+int run_partial_sort(const std::vector<V>& x, int k, V *xk, int *ik)
+{
+  std::vector<std::pair<V, int> > p = make_pairs(x);
+  int m = (k < (int) p.size()) ? k : p.size();
+  std::partial_sort(p.begin(), p.begin() + m, p.end());
+  for (int j = 0; j < m; j++) {
+    xk[j] = p[j].first;
+    ik[j] = p[j].second;
+  }
+  return m;
+}
+
+/* Percentile (0..100) of sorted t, linear interpolation */
+
+double percentile(const std::vector<double>& t, double q)
+{
+  double r = q / 100.0 * (t.size() - 1);
+  std::size_t lo = (std::size_t) std::floor(r);
+  std::size_t hi = (lo + 1 < t.size()) ? lo + 1 : lo;
+  return t[lo] + (r - lo) * (t[hi] - t[lo]);
+}
+
+/* CSV field: x, or empty if not counted (x < 0) */
+
+void print_counter(double x)
+{
+  if (x >= 0.0) std::printf(",%.4f", x); else std::printf(",");
+}
+
+template <class V>
+int bench_type(fclk_counters *pc, int trials, int maxn, unsigned long long seed)
+{
+  typedef int (*method)(const std::vector<V>&, int, V *, int *);
+  const char *names[] = { "mmheap", "topk", "cmmheap", "priority_queue", "nth_element", "partial_sort" };
+  method methods[] = { run_mmheap<V>, run_topk<V>, run_cmmheap<V>, run_priority_queue<V>,
+                       run_nth_element<V>, run_partial_sort<V> };
+  const int nmethods = sizeof(methods) / sizeof(methods[0]);
+  int numerr = 0;
+
+  for (int n = 1000; n <= maxn; n *= 10) {
+    for (int dist = 0; dist < ndists; dist++) {
+      // the same input for every method and trial of this (type, n, dist)
+      std::mt19937_64 g(seed + 1000003ull * n + dist);
+      std::vector<V> x = make_input<V>(dist, n, g);
+      for (int k = 1; k <= n / 10; k *= 10) {
+        std::vector<V> xr(k), xk(k);
+        std::vector<int> ik(k);
+        run_nth_element(x, k, xr.data(), ik.data());
+        for (int m = 0; m < nmethods; m++) {
+          std::vector<double> t(trials);
+          fclk_counters sum = *pc;  // counter totals over the trials
+          for (int c = 0; c < FCLK_NCOUNTERS; c++) sum.value[c] = 0;
+          int r = 0;
+          for (int trial = 0; trial < trials; trial++) {
+            fclk_timespec __tic, __toc;
+            fclk_counters_start(pc);
+            fclk_timestamp(&__tic);
+            r = methods[m](x, k, xk.data(), ik.data());
+            fclk_timestamp(&__toc);
+            fclk_counters_stop(pc);
+            t[trial] = fclk_delta_timestamps(&__tic, &__toc) * 1.0e6;
+            for (int c = 0; c < FCLK_NCOUNTERS; c++) {
+              sum.value[c] += pc->value[c];
+              sum.valid[c] = pc->valid[c];
+            }
+            if (r < 0) break;
+          }
+          if (r < 0) continue;
+          bool ok = (r == k);
+          for (int j = 0; ok && j < k; j++) ok = (xk[j] == xr[j] && x[ik[j]] == xk[j]);
+          if (!ok) {
+            std::cerr << "mismatch: " << names[m] << " " << value_traits<V>::name() << " "
+                      << dists[dist] << " n=" << n << " k=" << k << std::endl;
+            numerr++;
+          }
+          std::sort(t.begin(), t.end());
+          std::printf("%s,%s,%d,%d,%s,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f",
+                      value_traits<V>::name(), dists[dist], n, k, names[m], trials,
+                      t.front(), percentile(t, 10.0), percentile(t, 50.0), percentile(t, 90.0),
+                      percentile(t, 99.0), t.back(), percentile(t, 50.0) * 1.0e3 / n);
+          double elems = (double) n * trials;
+          print_counter(fclk_counters_ipc(&sum));
+          print_counter(fclk_counters_per(&sum, FCLK_BRANCH_MISSES, elems));
+          print_counter(fclk_counters_per(&sum, FCLK_L1D_MISSES, elems));
+          print_counter(fclk_counters_per(&sum, FCLK_LLC_MISSES, elems));
+          std::printf("\n");
+        }
+      }
+    }
+  }
+  return numerr;
+}
+
+/* Per-operation latency (-l) */
+
+enum { OP_INSERT, OP_REPLACEMAX, OP_REMOVEMIN, OP_REMOVEMAX, NOPS };
+const char *opnames[NOPS] = { "Insert", "ReplaceMax", "RemoveMin", "RemoveMax" };
+
+template <class V>
+struct mmheap_ops
+{
+  MinMaxHeap<V, int> h;
+  mmheap_ops(int k) : h(k) { }
+  void insert(V v, int i) { h.Insert(v, i); }
+  void replacemax(V v, int i) { h.ReplaceMax(v, i); }
+  void removemin() { h.RemoveMin(); }
+  void removemax() { h.RemoveMax(); }
+};
+
+struct cmmheap_ops
+{
+  minmaxheap *p;
+  cmmheap_ops(int k) : p(mmheap_create(k)) { }
+  ~cmmheap_ops() { mmheap_destroy(p); }
+  void insert(double v, int i) { mmheap_insert(p, v, i); }
+  void replacemax(double v, int i) { mmheap_replacemax(p, v, i); }
+  void removemin() { mmheap_removemin(p); }
+  void removemax() { mmheap_removemax(p); }
+};
+
+inline void record(fclk_histogram *h, unsigned long long t0, unsigned long long t1, unsigned long long ovh)
+{
+  unsigned long long t = t1 - t0;
+  fclk_histogram_add(h, (t > ovh) ? t - ovh : 0);
+}
+
+/* rounds of: fill an empty heap to k, k ReplaceMax, then empty it with
+   RemoveMin (first half) and RemoveMax (second half) */
+
+template <class V, class H>
+void latency_heap(const char *heap, const std::vector<V>& x, int k, int rounds, unsigned long long ovh)
+{
+  std::vector<fclk_histogram> hist(NOPS);
+  for (int o = 0; o < NOPS; o++) fclk_histogram_clear(&hist[o]);
+  int n = x.size();
+  int j = 0;
+  H h(k);
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < k; i++, j = (j + 1 == n) ? 0 : j + 1) {
+      V v = x[j];
+      unsigned long long t0 = fclk_ticks();
+      h.insert(v, j);
+      record(&hist[OP_INSERT], t0, fclk_ticks_end(), ovh);
+    }
+    for (int i = 0; i < k; i++, j = (j + 1 == n) ? 0 : j + 1) {
+      V v = x[j];
+      unsigned long long t0 = fclk_ticks();
+      h.replacemax(v, j);
+      record(&hist[OP_REPLACEMAX], t0, fclk_ticks_end(), ovh);
+    }
+    for (int i = 0; i < k / 2; i++) {
+      unsigned long long t0 = fclk_ticks();
+      h.removemin();
+      record(&hist[OP_REMOVEMIN], t0, fclk_ticks_end(), ovh);
+    }
+    for (int i = k / 2; i < k; i++) {
+      unsigned long long t0 = fclk_ticks();
+      h.removemax();
+      record(&hist[OP_REMOVEMAX], t0, fclk_ticks_end(), ovh);
+    }
+  }
+  for (int o = 0; o < NOPS; o++) {
+    const fclk_histogram *ph = &hist[o];
+    std::printf("%s,%s,%d,%s,%llu,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+                value_traits<V>::name(), heap, k, opnames[o], ph->n,
+                fclk_ticks_to_ns(fclk_histogram_mean(ph)),
+                fclk_ticks_to_ns((double) fclk_histogram_percentile(ph, 50.0)),
+                fclk_ticks_to_ns((double) fclk_histogram_percentile(ph, 99.0)),
+                fclk_ticks_to_ns((double) fclk_histogram_percentile(ph, 99.9)),
+                fclk_ticks_to_ns((double) ph->max));
+  }
+}
+
+template <class V>
+void latency_cmmheap(const std::vector<V>&, int, int, unsigned long long)
+{
+  // C heap is double only
+}
+
+template <>
+void latency_cmmheap<double>(const std::vector<double>& x, int k, int rounds, unsigned long long ovh)
+{
+  latency_heap<double, cmmheap_ops>("cmmheap", x, k, rounds, ovh);
+}
+
+template <class V>
+void latency_type(int trials, int maxn, unsigned long long seed, unsigned long long ovh)
+{
+  std::mt19937_64 g(seed);
+  std::vector<V> x = make_input<V>(0, maxn, g);
+  for (int k = 10; k <= maxn / 10; k *= 10) {
+    int rounds = (100000 / k > trials) ? 100000 / k : trials;
+    latency_heap<V, mmheap_ops<V> >("mmheap", x, k, rounds, ovh);
+    latency_cmmheap<V>(x, k, rounds, ovh);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int trials = 11;
+  int maxn = 1000000;
+  unsigned long long seed = 20240601ull;
+  bool latency = false;
+
+  int c;
+  while ((c = getopt(argc, argv, "t:n:s:l")) != -1) {
+    switch (c) {
+    case 't': trials = std::atoi(optarg); break;
+    case 'n': maxn = std::atoi(optarg); break;
+    case 's': seed = std::strtoull(optarg, nullptr, 10); break;
+    case 'l': latency = true; break;
+    default:
+      std::cerr << "usage: " << argv[0] << " [-t trials] [-n maxn] [-s seed] [-l] > results.csv" << std::endl;
+      return 1;
+    }
+  }
+  if (trials < 1 || maxn < 1000) {
+    std::cerr << "trials >= 1 and maxn >= 1000 required" << std::endl;
+    return 1;
+  }
+
+  if (latency) {
+    fclk_ticks_calibrate();
+    unsigned long long ovh = fclk_ticks_overhead();
+    std::cerr << "tick " << fclk_ticks_to_ns(1.0) << " ns, timer overhead " << ovh << " ticks (subtracted)" << std::endl;
+    std::printf("type,heap,k,op,count,mean_ns,p50_ns,p99_ns,p999_ns,max_ns\n");
+    latency_type<double>(trials, maxn, seed, ovh);
+    latency_type<float>(trials, maxn, seed, ovh);
+    latency_type<std::int32_t>(trials, maxn, seed, ovh);
+    latency_type<std::int64_t>(trials, maxn, seed, ovh);
+    return 0;
+  }
+
+  fclk_counters pc;
+  if (fclk_counters_open(&pc) == 0) {
+    std::cerr << "hardware counters not available; timing only" << std::endl;
+  }
+
+  std::printf("type,dist,n,k,method,trials,min_us,p10_us,median_us,p90_us,p99_us,max_us,median_ns_per_elem,"
+              "ipc,branch_misses_per_elem,l1d_misses_per_elem,llc_misses_per_elem\n");
+  int numerr = 0;
+  numerr += bench_type<double>(&pc, trials, maxn, seed);
+  numerr += bench_type<float>(&pc, trials, maxn, seed);
+  numerr += bench_type<std::int32_t>(&pc, trials, maxn, seed);
+  numerr += bench_type<std::int64_t>(&pc, trials, maxn, seed);
+  fclk_counters_close(&pc);
+
+  if (numerr != 0) {
+    std::cerr << numerr << " mismatches" << std::endl;
+    return 1;
+  }
+  return 0;
+}
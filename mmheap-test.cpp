@@ -15,11 +15,1173 @@
 #include <random>
 #include <chrono>
 #include <ctime>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <queue>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <thread>
 #include "fastclock.h"
 #include "mmheap.h"
+#include "pmmheap.h"
+#include "fmmheap.h"
 
 const int kmaxshow = 30;
 
+/* IPC and hardware counter events per element of a region over n
+   elements, or a note that only its time was measured */
+
+void print_counters(const fclk_counters& pc, int n, const char *label)
+{
+  const char *names[FCLK_NCOUNTERS] = { "cycles", "instructions", "branch misses", "L1D misses", "LLC misses" };
+  std::cout << "counters[" << label << "]:";
+  int m = 0;
+  if (fclk_counters_ipc(&pc) >= 0.0) std::cout << (m++ ? ", " : " ") << "IPC " << fclk_counters_ipc(&pc);
+  for (int c = 0; c < FCLK_NCOUNTERS; c++) {
+    if (pc.valid[c]) std::cout << (m++ ? ", " : " ") << names[c] << "/elem " << fclk_counters_per(&pc, c, n);
+  }
+  std::cout << (m ? "" : " not available (time only)") << std::endl;
+}
+
+/* Per-operation cost of the heap kernels: fill a heap with all of x,
+   then empty it with RemoveMin (first half) and RemoveMax (second half) */
+void time_heap_ops(const std::vector<double>& x, const char *label)
+{
+  fclk_timespec __tic, __toc;
+  int n = x.size();
+  MinMaxHeap<double, int> h(n);
+
+  fclk_timestamp(&__tic);
+  for (int i = 0; i < n; i++) {
+    h.Insert(x[i], i);
+  }
+  fclk_timestamp(&__toc);
+  double elap_ins = fclk_delta_timestamps(&__tic, &__toc);
+
+  fclk_timestamp(&__tic);
+  for (int i = 0; i < n / 2; i++) {
+    h.RemoveMin();
+  }
+  fclk_timestamp(&__toc);
+  double elap_rmin = fclk_delta_timestamps(&__tic, &__toc);
+
+  int r = h.Length();
+  fclk_timestamp(&__tic);
+  while (h.RemoveMax()) { }
+  fclk_timestamp(&__toc);
+  double elap_rmax = fclk_delta_timestamps(&__tic, &__toc);
+
+  std::cout << "ops[" << label << "]: Insert " << elap_ins * 1.0e9 / n
+            << " ns, RemoveMin " << elap_rmin * 1.0e9 / (n / 2 > 0 ? n / 2 : 1)
+            << " ns, RemoveMax " << elap_rmax * 1.0e9 / (r > 0 ? r : 1) << " ns" << std::endl;
+}
+
+/* Storage layout comparison: ns per element to Insert x[0..k) into a
+   capacity-k heap and then empty it with alternating RemoveMin/RemoveMax */
+template <class V, class I, class L, int D = 2>
+double time_layout(const std::vector<V>& x, int k)
+{
+  fclk_timespec __tic, __toc;
+  MinMaxHeap<V, I, L, D> h(k);
+  fclk_timestamp(&__tic);
+  for (int i = 0; i < k; i++) {
+    h.Insert(x[i], I(i));
+  }
+  while (h.RemoveMin() && h.RemoveMax()) { }
+  fclk_timestamp(&__toc);
+  return fclk_delta_timestamps(&__tic, &__toc) * 1.0e9 / k;
+}
+
+template <class V, class L>
+double time_layout_keys(const std::vector<V>& x, int k)
+{
+  fclk_timespec __tic, __toc;
+  MinMaxHeap<V, void, L> h(k);
+  fclk_timestamp(&__tic);
+  for (int i = 0; i < k; i++) {
+    h.Insert(x[i]);
+  }
+  while (h.RemoveMin() && h.RemoveMax()) { }
+  fclk_timestamp(&__toc);
+  return fclk_delta_timestamps(&__tic, &__toc) * 1.0e9 / k;
+}
+
+template <class V, class I>
+void time_layouts(const std::vector<double>& x, int k, double scale, const char *label)
+{
+  std::vector<V> xv(k);
+  for (int i = 0; i < k; i++) {
+    xv[i] = V(x[i] * scale);
+  }
+  std::cout << "layout[" << label << ", k=" << k << "]: Split "
+            << time_layout<V, I, MinMaxHeapLayout::Split>(xv, k) << " ns, Interleaved "
+            << time_layout<V, I, MinMaxHeapLayout::Interleaved>(xv, k) << " ns, Blocked "
+            << time_layout<V, I, MinMaxHeapLayout::Blocked>(xv, k) << " ns, keys-only "
+            << time_layout_keys<V, MinMaxHeapLayout::Split>(xv, k) << " ns" << std::endl;
+}
+/* Drain order of a capacity-k heap of x[0..k) for one layout and arity:
+   DrainAscending and DrainDescending against a sorted copy of the
+   (value, index) pairs, every index coming back once and on its own
+   value. With exact set ties must also come out by index (Packed keys).
+   Returns the number of mismatches. */
+template <class V, class I, class L, int D = 2>
+int check_drain_order(const std::vector<V>& x, int k, bool exact)
+{
+  std::vector<std::pair<V, I> > xs(k);
+  for (int i = 0; i < k; i++) {
+    xs[i] = std::make_pair(x[i], I(i));
+  }
+  std::sort(xs.begin(), xs.end());
+  std::vector<V> v(k);
+  std::vector<I> ix(k);
+  int numerr = 0;
+  for (int desc = 0; desc < 2; desc++) {
+    MinMaxHeap<V, I, L, D> h(k);
+    for (int i = 0; i < k; i++) {
+      h.Insert(x[i], I(i));
+    }
+    int m = desc ? h.DrainDescending(v.data(), ix.data()) : h.DrainAscending(v.data(), ix.data());
+    if (m != k || h.Length() != 0) numerr++;
+    std::vector<char> seen(k, 0);
+    for (int i = 0; i < k; i++) {
+      const std::pair<V, I>& e = xs[desc ? k - 1 - i : i];
+      if (v[i] != e.first || ix[i] < 0 || ix[i] >= (I) k || seen[ix[i]]++ != 0 || x[ix[i]] != v[i]) numerr++;
+      else if (exact && ix[i] != e.second) numerr++;
+    }
+  }
+  return numerr;
+}
+
+int check_layouts(const std::vector<double>& x, int k)
+{
+  int numerr = 0;
+  numerr += check_drain_order<double, int, MinMaxHeapLayout::Split>(x, k, false);
+  numerr += check_drain_order<double, int, MinMaxHeapLayout::Interleaved>(x, k, false);
+  numerr += check_drain_order<double, int, MinMaxHeapLayout::Blocked>(x, k, false);
+  std::vector<long long> xt(k);  // 16 distinct values, many ties
+  for (int i = 0; i < k; i++) {
+    xt[i] = (long long) (x[i] * 16.0);
+  }
+  numerr += check_drain_order<long long, long long, MinMaxHeapLayout::Split>(xt, k, false);
+  numerr += check_drain_order<long long, long long, MinMaxHeapLayout::Interleaved>(xt, k, false);
+  numerr += check_drain_order<long long, long long, MinMaxHeapLayout::Blocked>(xt, k, false);
+  numerr += check_drain_order<double, int, MinMaxHeapLayout::Split, 4>(x, k, false);
+  numerr += check_drain_order<double, int, MinMaxHeapLayout::Blocked, 4>(x, k, false);
+  numerr += check_drain_order<double, int, MinMaxHeapLayout::Split, 8>(x, k, false);
+  numerr += check_drain_order<double, int, MinMaxHeapLayout::Blocked, 8>(x, k, false);
+  numerr += check_drain_order<long long, long long, MinMaxHeapLayout::Interleaved, 4>(xt, k, false);
+  numerr += check_drain_order<long long, long long, MinMaxHeapLayout::Blocked, 8>(xt, k, false);
+  std::vector<float> xf(x.begin(), x.begin() + k), xft(k);  // xft: -8 .. 7, many ties
+  for (int i = 0; i < k; i++) {
+    xft[i] = (float) (std::floor(x[i] * 16.0) - 8.0);
+  }
+  numerr += check_drain_order<float, int, MinMaxHeapLayout::Packed>(xf, k, true);
+  numerr += check_drain_order<float, int, MinMaxHeapLayout::Packed>(xft, k, true);
+  numerr += check_drain_order<float, int, MinMaxHeapLayout::Packed, 4>(xft, k, true);
+  numerr += check_drain_order<float, int, MinMaxHeapLayout::Packed, 8>(xft, k, true);
+  if (numerr != 0) {
+    std::cout << "layout drain order: " << numerr << " mismatches" << std::endl;
+  }
+  return numerr;
+}
+
+/* Allocator policy that counts the allocate calls made to the policy A
+   it wraps (for the allocator policy benchmark) */
+template <class A>
+struct CountingAlloc : A
+{
+  CountingAlloc(const A& a = A()) : A(a) { }
+  void *allocate(std::size_t bytes, std::size_t align) {
+    allocs++;
+    return A::allocate(bytes, align);
+  }
+  static long allocs;
+};
+
+template <class A>
+long CountingAlloc<A>::allocs = 0;
+
+/* Short-lived heaps, as in a request handler: insert k elements (count not
+   known up front) and pop the few smallest. Reports ns and allocator
+   calls per request for a fixed capacity-k heap, a growable heap
+   starting at capacity 1 (calls to operator new), and the same in an
+   arena reset per request (served by the arena) */
+template <class H, class F>
+void time_request(const std::vector<double>& x, int k, int reqs, F make,
+                  const long *counter, double *ns, double *allocs)
+{
+  fclk_timespec __tic, __toc;
+  double sink = 0.0;
+  long a0 = *counter;
+  fclk_timestamp(&__tic);
+  for (int r = 0; r < reqs; r++) {
+    const double *xr = x.data() + (r % (x.size() / k)) * k;
+    H h = make();
+    for (int i = 0; i < k; i++) {
+      h.Insert(xr[i], i);
+    }
+    double v;
+    for (int j = 0; j < 8 && h.PeekMinValue(&v); j++) {
+      sink += v;
+      h.RemoveMin();
+    }
+  }
+  fclk_timestamp(&__toc);
+  *ns = fclk_delta_timestamps(&__tic, &__toc) * 1.0e9 / reqs + 0.0 * sink;
+  *allocs = (double) (*counter - a0) / reqs;
+}
+
+void time_alloc_policies(const std::vector<double>& x, int k)
+{
+  typedef CountingAlloc<MinMaxHeapAlloc::New> new_alloc;
+  typedef CountingAlloc<MinMaxHeapAlloc::ArenaRef> arena_alloc;
+  typedef MinMaxHeap<double, int, MinMaxHeapLayout::Split, 2, new_alloc> fixed_heap;
+  typedef MinMaxHeap<double, int, MinMaxHeapLayout::Split, 2, arena_alloc> arena_heap;
+  const int reqs = 1000;
+  MinMaxHeapAlloc::Arena arena;
+  double ns[3], allocs[3];
+
+  time_request<fixed_heap>(x, k, reqs, [k]() { return fixed_heap(k); }, &new_alloc::allocs, &ns[0], &allocs[0]);
+  time_request<fixed_heap>(x, k, reqs, []() { return fixed_heap(1, true); }, &new_alloc::allocs, &ns[1], &allocs[1]);
+  time_request<arena_heap>(x, k, reqs, [&arena]() {
+      arena.Reset();
+      return arena_heap(1, true, arena_alloc(MinMaxHeapAlloc::ArenaRef(arena)));
+    }, &arena_alloc::allocs, &ns[2], &allocs[2]);
+
+  std::cout << "alloc[k=" << k << ", per request]: fixed " << ns[0] << " ns " << allocs[0]
+            << " allocs, growable " << ns[1] << " ns " << allocs[1]
+            << " allocs, growable arena " << ns[2] << " ns " << allocs[2] << " arena allocs" << std::endl;
+}
+
+/* Heavy payloads: std::string values (longer than the small-string buffer)
+   keyed like x. ns per element to fill a capacity-k heap and drain it with
+   RemoveMin, for copied, moved and emplaced values, vs std::priority_queue */
+void time_payloads(const std::vector<double>& x, int k)
+{
+  fclk_timespec __tic, __toc;
+  std::vector<std::string> keys(k);
+  for (int i = 0; i < k; i++) {
+    char buf[64];
+    std::snprintf(buf, sizeof(buf), "%.17f-payload-payload", x[i]);
+    keys[i] = buf;
+  }
+  double ns[4];
+
+  for (int mode = 0; mode < 3; mode++) {
+    std::vector<std::string> src(keys);
+    MinMaxHeap<std::string, int> h(k);
+    fclk_timestamp(&__tic);
+    for (int i = 0; i < k; i++) {
+      if (mode == 0) h.Insert(src[i], i);
+      else if (mode == 1) h.Insert(std::move(src[i]), i);
+      else h.Emplace(i, src[i].data(), src[i].size());
+    }
+    while (h.RemoveMin()) { }
+    fclk_timestamp(&__toc);
+    ns[mode] = fclk_delta_timestamps(&__tic, &__toc) * 1.0e9 / k;
+  }
+
+  {
+    std::vector<std::string> src(keys);
+    std::priority_queue<std::string, std::vector<std::string>, std::greater<std::string> > q;
+    fclk_timestamp(&__tic);
+    for (int i = 0; i < k; i++) {
+      q.push(std::move(src[i]));
+    }
+    while (!q.empty()) q.pop();
+    fclk_timestamp(&__toc);
+    ns[3] = fclk_delta_timestamps(&__tic, &__toc) * 1.0e9 / k;
+  }
+
+  std::cout << "payload[string, k=" << k << "]: Insert copy " << ns[0] << " ns, Insert move "
+            << ns[1] << " ns, Emplace " << ns[2] << " ns, std::priority_queue "
+            << ns[3] << " ns" << std::endl;
+}
+
+/* Re-prioritization of queued elements: ns per Update(i, v) and per
+   Erase(i) + Insert(v, i) on a full addressable heap of k elements, vs
+   rebuilding a plain heap after each change. Returns the number of
+   ordering errors found when draining the addressable heap. */
+int time_updates(const std::vector<double>& x, int k)
+{
+  fclk_timespec __tic, __toc;
+  int n = x.size();
+  std::vector<double> cur(x.begin(), x.begin() + k);
+  AddressableMinMaxHeap<double, int> h(k);
+  for (int i = 0; i < k; i++) {
+    h.Insert(cur[i], i);
+  }
+
+  fclk_timestamp(&__tic);
+  for (int j = 0; j < n; j++) {
+    int i = (int) (((long long) j * 7919) % k);
+    cur[i] = x[n - 1 - j];
+    h.Update(i, cur[i]);
+  }
+  fclk_timestamp(&__toc);
+  double ns_update = fclk_delta_timestamps(&__tic, &__toc) * 1.0e9 / n;
+
+  fclk_timestamp(&__tic);
+  for (int j = 0; j < n; j++) {
+    int i = (int) (((long long) j * 7919) % k);
+    cur[i] = x[j];
+    h.Erase(i);
+    h.Insert(cur[i], i);
+  }
+  fclk_timestamp(&__toc);
+  double ns_erase = fclk_delta_timestamps(&__tic, &__toc) * 1.0e9 / n;
+
+  int reps = 10;
+  MinMaxHeap<double, int> r(k);
+  fclk_timestamp(&__tic);
+  for (int j = 0; j < reps; j++) {
+    r.Clear();
+    for (int i = 0; i < k; i++) {
+      r.Insert(cur[i], i);
+    }
+  }
+  fclk_timestamp(&__toc);
+  double ns_rebuild = fclk_delta_timestamps(&__tic, &__toc) * 1.0e9 / reps;
+
+  std::cout << "addressable[k=" << k << "]: Update " << ns_update << " ns, Erase+Insert "
+            << ns_erase << " ns, rebuild " << ns_rebuild << " ns" << std::endl;
+
+  int numerr = 0;
+  std::sort(cur.begin(), cur.end());
+  for (int i = 0; i < k; i++) {
+    double v = 0.0;
+    h.PeekMinValue(&v);
+    h.RemoveMin();
+    if (v != cur[i]) numerr++;
+  }
+  if (numerr != 0) {
+    std::cout << "addressable heap: " << numerr << " ordering errors" << std::endl;
+  }
+  return numerr;
+}
+
+/* Building a heap of all of x: n Inserts vs the O(n) bulk constructor
+   vs Assign into an existing heap; returns the number of mismatches of
+   the bulk-built heap's extremes against sorted x */
+int time_heapify(const std::vector<double>& x)
+{
+  fclk_timespec __tic, __toc;
+  int n = x.size();
+
+  MinMaxHeap<double, int> h(n);
+  fclk_timestamp(&__tic);
+  for (int i = 0; i < n; i++) {
+    h.Insert(x[i], i);
+  }
+  fclk_timestamp(&__toc);
+  double ms_insert = fclk_delta_timestamps(&__tic, &__toc) * 1.0e3;
+
+  fclk_timestamp(&__tic);
+  MinMaxHeap<double, int> b(x.data(), nullptr, n);
+  fclk_timestamp(&__toc);
+  double ms_build = fclk_delta_timestamps(&__tic, &__toc) * 1.0e3;
+
+  fclk_timestamp(&__tic);
+  h.Assign(x.data(), nullptr, n);
+  fclk_timestamp(&__toc);
+  double ms_assign = fclk_delta_timestamps(&__tic, &__toc) * 1.0e3;
+
+  std::cout << "build[n=" << n << "]: Insert " << ms_insert << " ms, bulk constructor "
+            << ms_build << " ms, Assign " << ms_assign << " ms" << std::endl;
+
+  std::vector<double> xs(x);
+  std::sort(xs.begin(), xs.end());
+  int numerr = 0;
+  for (int i = 0; b.Length() > 0; i++) {
+    double lo = 0.0, hi = 0.0;
+    int j = -1;
+    b.PeekMinValue(&lo);
+    b.PeekMinIndex(&j);
+    b.PeekMaxValue(&hi);
+    if (lo != xs[i] || hi != xs[n - 1 - i] || x[j] != lo) numerr++;
+    b.RemoveMin();
+    b.RemoveMax();
+  }
+
+  // an Assign that cannot grow the heap leaves it as it was
+  typedef MinMaxHeap<double, int, MinMaxHeapLayout::Split, 2, MinMaxHeapAlloc::ArenaRef> arena_heap;
+  alignas(std::max_align_t) char buf[1024];
+  MinMaxHeapAlloc::Arena arena(buf, sizeof(buf));
+  arena_heap g(8, true, MinMaxHeapAlloc::ArenaRef(arena));
+  MinMaxHeap<double, int> f(4);
+  std::vector<double> big(1024, 0.0);
+  for (int i = 0; i < 4; i++) {
+    g.Insert(4.0 - i, i);
+    f.Insert(4.0 - i, i);
+  }
+  double lo = 0.0, hi = 0.0;
+  if (g.Assign(big.data(), nullptr, 1024) || g.Length() != 4 || !g.PeekMinValue(&lo) || !g.PeekMaxValue(&hi)
+      || lo != 1.0 || hi != 4.0) numerr++;
+  if (f.Assign(big.data(), nullptr, 5) || f.Length() != 4 || !f.PeekMinValue(&lo) || !f.PeekMaxValue(&hi)
+      || lo != 1.0 || hi != 4.0) numerr++;
+
+  // bounded inserts into capacity 0 (moved from; exhausted arena) reject, or grow if growable
+  MinMaxHeap<double, int> mf(std::move(f)), gf(1, true), mg(std::move(gf));
+  arena_heap z(1024, false, MinMaxHeapAlloc::ArenaRef(arena));  // does not fit in buf
+  double ev = 0.0;
+  int ei = -1;
+  if (f.MaxLength() != 0 || !f.InsertOrEvictMax(2.0, 2, &ev, &ei) || ev != 2.0 || ei != 2 || f.Length() != 0) numerr++;
+  if (!f.InsertOrEvictMin(3.0, 3, &ev, &ei) || ev != 3.0 || ei != 3 || f.Length() != 0) numerr++;
+  if (z.MaxLength() != 0 || !z.InsertOrEvictMax(5.0, 5, &ev, &ei) || ev != 5.0 || ei != 5) numerr++;
+  if (!z.InsertOrEvictMin(6.0, 6, &ev, &ei) || ev != 6.0 || ei != 6 || z.Length() != 0) numerr++;
+  if (gf.InsertOrEvictMax(7.0, 7, &ev, &ei) || gf.Length() != 1 || !gf.PeekMinValue(&lo) || lo != 7.0) numerr++;
+  if (mf.Length() != 4) numerr++;
+
+  if (numerr != 0) {
+    std::cout << "bulk constructor: " << numerr << " mismatches" << std::endl;
+  }
+  return numerr;
+}
+
+/* Merge the two halves of x: full union (MergeFrom) and the k smallest
+   of the union (MergeBounded), each against draining one heap into the
+   other; returns the number of mismatches. */
+
+int time_merge(const std::vector<double>& x, int k)
+{
+  fclk_timespec __tic, __toc;
+  int n = x.size();
+  int h1 = n / 2;
+
+  MinMaxHeap<double, int> a(x.data(), nullptr, h1, n);
+  MinMaxHeap<double, int> b(n - h1);
+  for (int i = h1; i < n; i++) b.Insert(x[i], i);
+
+  MinMaxHeap<double, int> na(a), nb(b);
+  fclk_timestamp(&__tic);
+  double v;
+  int j;
+  while (nb.PeekMinValue(&v)) {
+    nb.PeekMinIndex(&j);
+    na.Insert(v, j);
+    nb.RemoveMin();
+  }
+  fclk_timestamp(&__toc);
+  double ms_naive = fclk_delta_timestamps(&__tic, &__toc) * 1.0e3;
+
+  MinMaxHeap<double, int> ma(a);
+  fclk_timestamp(&__tic);
+  ma.MergeFrom(b);
+  fclk_timestamp(&__toc);
+  double ms_merge = fclk_delta_timestamps(&__tic, &__toc) * 1.0e3;
+
+  MinMaxHeap<double, int> ka(a), kb(b);
+  fclk_timestamp(&__tic);
+  while (ka.Length() > k) ka.RemoveMax();
+  while (kb.PeekMinValue(&v)) {
+    kb.PeekMinIndex(&j);
+    ka.InsertOrEvictMax(v, j, nullptr, nullptr);
+    kb.RemoveMin();
+  }
+  fclk_timestamp(&__toc);
+  double ms_knaive = fclk_delta_timestamps(&__tic, &__toc) * 1.0e3;
+
+  MinMaxHeap<double, int> kc(a);
+  fclk_timestamp(&__tic);
+  kc.MergeBounded(b, k);
+  fclk_timestamp(&__toc);
+  double ms_bounded = fclk_delta_timestamps(&__tic, &__toc) * 1.0e3;
+
+  std::cout << "merge[" << h1 << "+" << (n - h1) << "]: drain-and-insert " << ms_naive
+            << " ms, MergeFrom " << ms_merge << " ms; k=" << k << ": drain-and-insert "
+            << ms_knaive << " ms, MergeBounded " << ms_bounded << " ms" << std::endl;
+
+  std::vector<double> xs(x);
+  std::sort(xs.begin(), xs.end());
+  int numerr = (ma.Length() != n || kc.Length() != k) ? 1 : 0;
+  for (int i = 0; i < n && ma.PeekMinValue(&v); i++) {
+    ma.PeekMinIndex(&j);
+    if (v != xs[i] || x[j] != v) numerr++;
+    ma.RemoveMin();
+  }
+  for (int i = k - 1; i >= 0 && kc.PeekMaxValue(&v); i--) {
+    kc.PeekMaxIndex(&j);
+    if (v != xs[i] || x[j] != v) numerr++;
+    kc.RemoveMax();
+  }
+  if (numerr != 0) {
+    std::cout << "merge: " << numerr << " mismatches" << std::endl;
+  }
+  return numerr;
+}
+
+/* Output stage of a k-element heap: PeekMin + RemoveMin loop against
+   DrainAscending, and half of the heap with PopMaxN; returns the number
+   of mismatches. */
+
+int time_drain(const std::vector<double>& x, int k)
+{
+  fclk_timespec __tic, __toc;
+  std::vector<double> xo(k), xd(k);
+  std::vector<int> io(k), id(k);
+
+  MinMaxHeap<double, int> a(x.data(), nullptr, k);
+  MinMaxHeap<double, int> b(a), c(a);
+  fclk_timestamp(&__tic);
+  for (int j = 0; a.PeekMinValue(&xo[j]); j++) {
+    a.PeekMinIndex(&io[j]);
+    a.RemoveMin();
+  }
+  fclk_timestamp(&__toc);
+  double ms_loop = fclk_delta_timestamps(&__tic, &__toc) * 1.0e3;
+
+  fclk_timestamp(&__tic);
+  int nd = b.DrainAscending(xd.data(), id.data());
+  fclk_timestamp(&__toc);
+  double ms_drain = fclk_delta_timestamps(&__tic, &__toc) * 1.0e3;
+
+  int h = k / 2;
+  std::vector<double> xm(k);
+  fclk_timestamp(&__tic);
+  int nm = c.PopMaxN(h, xm.data());
+  fclk_timestamp(&__toc);
+  double ms_popmax = fclk_delta_timestamps(&__tic, &__toc) * 1.0e3;
+
+  std::cout << "drain[k=" << k << "]: peek/remove loop " << ms_loop << " ms, DrainAscending "
+            << ms_drain << " ms, PopMaxN(" << h << ") " << ms_popmax << " ms" << std::endl;
+
+  int numerr = (nd != k || nm != h || c.Length() != k - h) ? 1 : 0;
+  for (int j = 0; j < k; j++) {
+    if (xd[j] != xo[j] || x[id[j]] != xd[j]) numerr++;
+  }
+  for (int j = 0; j < h; j++) {
+    if (xm[j] != xo[k - 1 - j]) numerr++;
+  }
+  double v;
+  if (c.PeekMaxValue(&v) && v != xo[k - 1 - h]) numerr++;
+  if (numerr != 0) {
+    std::cout << "drain: " << numerr << " mismatches" << std::endl;
+  }
+  return numerr;
+}
+
+/* Running p50/p90/p99 over x, checked against nth_element on prefixes,
+   then throughput of bounded trackers over 10 passes through x (a
+   1e8-sample stream for n = 1e7); returns the number of mismatches. */
+
+int time_quantile(const std::vector<double>& x)
+{
+  fclk_timespec __tic, __toc;
+  int n = x.size();
+  const double qs[3] = {0.5, 0.9, 0.99};
+  int numerr = 0;
+
+  RunningQuantile<double> rq[3] = {RunningQuantile<double>(qs[0]), RunningQuantile<double>(qs[1]),
+                                   RunningQuantile<double>(qs[2])};
+  std::vector<double> xp;
+  int next = 1;
+  for (int j = 0; j < n; j++) {
+    for (int t = 0; t < 3; t++) rq[t].Push(x[j]);
+    if (j + 1 == next || j + 1 == n) {
+      for (int t = 0; t < 3; t++) {
+        xp.assign(x.begin(), x.begin() + j + 1);
+        long long r = (long long) (qs[t] * (j + 1));
+        if ((double) r < qs[t] * (j + 1)) r++;
+        if (r < 1) r = 1;
+        std::nth_element(xp.begin(), xp.begin() + (r - 1), xp.end());
+        double v = 0.0;
+        if (!rq[t].Quantile(&v) || v != xp[r - 1]) numerr++;
+      }
+      next *= 4;
+    }
+  }
+
+  const long long m = 10;
+  long long ns = m * n;
+  int cap = (n < (1 << 16)) ? n : (1 << 16);
+  double rate[3];
+  bool exact = true;
+  for (int t = 0; t < 3; t++) {
+    RunningQuantile<double> b(qs[t], cap);
+    fclk_timestamp(&__tic);
+    for (long long c = 0; c < m; c++) b.Push(x.begin(), x.end());
+    fclk_timestamp(&__toc);
+    rate[t] = ns / fclk_delta_timestamps(&__tic, &__toc) * 1.0e-6;
+    // every value of x appears m times: the r-th smallest is xs[(r-1)/m]
+    long long r = (long long) (qs[t] * ns);
+    if ((double) r < qs[t] * ns) r++;
+    if (r < 1) r = 1;
+    xp.assign(x.begin(), x.end());
+    std::nth_element(xp.begin(), xp.begin() + (r - 1) / m, xp.end());
+    double v = 0.0;
+    exact = exact && b.Exact();
+    if (b.Exact() && (!b.Quantile(&v) || v != xp[(r - 1) / m])) numerr++;
+  }
+
+  std::cout << "quantile[" << ns << " samples, cap " << cap << "]: p50 " << rate[0] << ", p90 " << rate[1]
+            << ", p99 " << rate[2] << " Msamples/s" << (exact ? "" : " (inexact)") << std::endl;
+  if (numerr != 0) {
+    std::cout << "quantile: " << numerr << " mismatches" << std::endl;
+  }
+  return numerr;
+}
+
+/* Sliding-window k-smallest over max(n, 2w) events (x repeated) for
+   windows w = 1e3 .. 1e7; the w = 1e3 run (and an untimed k-largest
+   twin) is checked against partial_sort of the window at every w-th
+   event. Returns the number of mismatches. */
+
+int time_window(const std::vector<double>& x, int k)
+{
+  fclk_timespec __tic, __toc;
+  int n = x.size();
+  int numerr = 0;
+  std::vector<double> xk(k), win;
+  std::vector<long long> ik(k);
+
+  std::cout << "window[k=" << k << "]:";
+  for (int w = 1000; w <= 10000000; w *= 10) {
+    long long ne = (n > 2LL * w) ? n : 2LL * w;
+    WindowTopK<double, long long> wt(k, w);
+    WindowTopK<double, long long> wl(k, w, true);
+    double elap = 0.0;
+    for (long long j = 0; j < ne; ) {
+      long long end = (w == 1000 && ne - j > w) ? j + w : ne;
+      fclk_timestamp(&__tic);
+      for (; j < end; j++) wt.Push(x[j % n]);
+      fclk_timestamp(&__toc);
+      elap += fclk_delta_timestamps(&__tic, &__toc);
+      if (w == 1000) {
+        long long lo = (j > w) ? j - w : 0;
+        for (long long q = wl.Count(); q < j; q++) wl.Push(x[q % n]);
+        win.clear();
+        for (long long q = lo; q < j; q++) win.push_back(x[q % n]);
+        int kk = (k < (int) win.size()) ? k : (int) win.size();
+        std::partial_sort(win.begin(), win.begin() + kk, win.end());
+        if (wt.Emit(xk.data(), ik.data()) != kk) numerr++;
+        for (int q = 0; q < kk; q++) {
+          if (xk[q] != win[q] || ik[q] < lo || ik[q] >= j || x[ik[q] % n] != xk[q]) numerr++;
+        }
+        std::partial_sort(win.begin(), win.begin() + kk, win.end(), std::greater<double>());
+        if (wl.Emit(xk.data(), ik.data()) != kk) numerr++;
+        for (int q = 0; q < kk; q++) {
+          if (xk[q] != win[q] || ik[q] < lo || ik[q] >= j || x[ik[q] % n] != xk[q]) numerr++;
+        }
+      }
+    }
+    std::cout << " w=" << w << " " << ne / elap * 1.0e-6 << " M/s";
+  }
+  std::cout << std::endl;
+  if (numerr != 0) {
+    std::cout << "window: " << numerr << " mismatches" << std::endl;
+  }
+  return numerr;
+}
+
+/* Concurrent mixed workload on a queue prefilled with half of x (each op
+   is an Insert followed by a RemoveMin) on 1, 2, 4, ... threads: one
+   mutex-guarded MinMaxHeap vs
+   ShardedMinMaxHeap relaxed and exact. Every index inserted must come
+   out exactly once (removed or left over); returns the number of
+   mismatches. */
+
+template <class Q>
+double run_concurrent(Q &q, const std::vector<double>& x, int nthreads, std::vector<int>& seen)
+{
+  fclk_timespec __tic, __toc;
+  int n = x.size();
+  int h = n / 2;
+  std::vector<std::vector<int> > out(nthreads);
+  std::vector<std::thread> workers;
+  for (int j = 0; j < h; j++) q.Insert(x[j], j);
+  auto work = [&](int t) {
+    double v;
+    int i;
+    for (int j = h + ((n - h) * t) / nthreads; j < h + ((n - h) * (t + 1)) / nthreads; j++) {
+      q.Insert(x[j], j);
+      if (q.RemoveMin(&v, &i)) out[t].push_back(i);
+    }
+  };
+  fclk_timestamp(&__tic);
+  for (int t = 1; t < nthreads; t++) workers.emplace_back(work, t);
+  work(0);
+  for (auto &w : workers) w.join();
+  fclk_timestamp(&__toc);
+  double v;
+  int i;
+  for (auto &o : out) {
+    for (int j : o) seen[j]++;
+  }
+  while (q.RemoveMin(&v, &i)) seen[i]++;
+  return (n - h) / fclk_delta_timestamps(&__tic, &__toc) * 1.0e-6;
+}
+
+struct locked_heap {
+  locked_heap() : heap(1024, true) { }
+  bool Insert(double v, int i) {
+    std::lock_guard<std::mutex> g(mutex);
+    return heap.Insert(v, i);
+  }
+  bool RemoveMin(double *v, int *i) {
+    std::lock_guard<std::mutex> g(mutex);
+    if (!heap.PeekMinValue(v)) return false;
+    heap.PeekMinIndex(i);
+    return heap.RemoveMin();
+  }
+  std::mutex mutex;
+  MinMaxHeap<double, int> heap;
+};
+
+int time_concurrent(const std::vector<double>& x)
+{
+  int maxthreads = std::thread::hardware_concurrency();
+  if (maxthreads < 2) maxthreads = 2;
+  int numerr = 0;
+  std::vector<int> seen(x.size());
+  for (int t = 1; ; t = (2 * t < maxthreads ? 2 * t : maxthreads)) {
+    double rate[3];
+    for (int mode = 0; mode < 3; mode++) {
+      std::fill(seen.begin(), seen.end(), 0);
+      if (mode == 0) {
+        locked_heap q;
+        rate[mode] = run_concurrent(q, x, t, seen);
+      } else {
+        ShardedMinMaxHeap<double, int> q(4 * t, 1024, mode == 2);
+        rate[mode] = run_concurrent(q, x, t, seen);
+      }
+      for (int c : seen) numerr += (c != 1);
+    }
+    std::cout << "concurrent[" << t << " threads]: mutex " << rate[0] << ", sharded relaxed " << rate[1]
+              << ", sharded exact " << rate[2] << " Mops/s" << std::endl;
+    if (t == maxthreads) break;
+  }
+  if (numerr != 0) {
+    std::cout << "concurrent: " << numerr << " mismatches" << std::endl;
+  }
+  return numerr;
+}
+
+/* Producers hand x over to one consumer that keeps the k smallest: one
+   mutex-guarded TopK::Push per element vs IngestTopK (lock-free ring,
+   batched drain, producers filter on the published threshold); SPSC
+   for one producer, MPSC otherwise. Returns the number of mismatches. */
+
+template <class Q>
+double run_ingest(Q &q, const std::vector<double>& x, int nproducers)
+{
+  fclk_timespec __tic, __toc;
+  int n = x.size();
+  std::atomic<int> running(nproducers);
+  std::vector<std::thread> producers;
+  fclk_timestamp(&__tic);
+  for (int t = 0; t < nproducers; t++) {
+    producers.emplace_back([&, t]() {
+      for (int j = (n * (long long) t) / nproducers; j < (n * (long long) (t + 1)) / nproducers; j++) {
+        while (!q.Offer(x[j], j)) std::this_thread::yield();
+      }
+      running--;
+    });
+  }
+  while (running.load() > 0) {
+    if (q.Drain() == 0) std::this_thread::yield();
+  }
+  q.Drain();
+  for (auto &p : producers) p.join();
+  fclk_timestamp(&__toc);
+  return n / fclk_delta_timestamps(&__tic, &__toc) * 1.0e-6;
+}
+
+struct locked_topk {
+  locked_topk(int k) : topk(k) { }
+  bool Offer(double v, int i) {
+    std::lock_guard<std::mutex> g(mutex);
+    topk.Push(v, i);
+    return true;
+  }
+  int Drain() { return 0; }
+  int Emit(double *xk, int *ik) { return topk.Emit(xk, ik); }
+  std::mutex mutex;
+  TopK<double, int> topk;
+};
+
+int time_ingest(const std::vector<double>& x, int k)
+{
+  int maxthreads = std::thread::hardware_concurrency();
+  if (maxthreads < 2) maxthreads = 2;
+  int numerr = 0;
+  std::vector<double> xs(x), xk(k);
+  std::vector<int> ik(k);
+  std::sort(xs.begin(), xs.end());
+  auto check = [&](int m) {
+    if (m != k) numerr++;
+    for (int j = 0; j < m; j++) {
+      if (xk[j] != xs[j] || x[ik[j]] != xk[j]) numerr++;
+    }
+  };
+  for (int t = 1; ; t = (2 * t < maxthreads ? 2 * t : maxthreads)) {
+    locked_topk a(k);
+    double r0 = run_ingest(a, x, t);
+    check(a.Emit(xk.data(), ik.data()));
+    double r1;
+    if (t == 1) {
+      IngestTopK<double, int, false> b(k);
+      r1 = run_ingest(b, x, t);
+      check(b.Emit(xk.data(), ik.data()));
+    } else {
+      IngestTopK<double, int> b(k);
+      r1 = run_ingest(b, x, t);
+      check(b.Emit(xk.data(), ik.data()));
+    }
+    std::cout << "ingest[" << t << " producers]: mutex per element " << r0 << ", ring "
+              << (t == 1 ? "SPSC " : "MPSC ") << r1 << " M/s" << std::endl;
+    if (t == maxthreads) break;
+  }
+  if (numerr != 0) {
+    std::cout << "ingest: " << numerr << " mismatches" << std::endl;
+  }
+  return numerr;
+}
+
+/* Top-k over a binary file of x: read() into a vector and scan it, against
+   ScanFile through mmap windows and through double-buffered read() chunks
+   (the file is in the page cache after it is written, so this is the
+   memory-side cost); indices are element offsets into the file. Returns
+   the number of mismatches. */
+
+int time_file(const std::vector<double>& x, int k)
+{
+  fclk_timespec __tic, __toc;
+  char path[] = "/tmp/mmheap-test-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    std::cout << "file: cannot create " << path << std::endl;
+    return 0;
+  }
+  std::size_t bytes = x.size() * sizeof(double);
+  bool ok = (write(fd, x.data(), bytes) == (ssize_t) bytes);
+  close(fd);
+  if (!ok) {
+    unlink(path);
+    std::cout << "file: cannot write " << path << std::endl;
+    return 0;
+  }
+
+  int numerr = 0;
+  std::vector<double> xs(x), xk(k);
+  std::vector<long long> ik(k);
+  std::sort(xs.begin(), xs.end());
+  auto check = [&](int m, bool largest) {
+    if (m != k) numerr++;
+    for (int j = 0; j < m; j++) {
+      double v = largest ? xs[x.size() - 1 - j] : xs[j];
+      if (xk[j] != v || x[ik[j]] != v) numerr++;
+    }
+  };
+
+  fclk_timestamp(&__tic);
+  {
+    std::vector<double> y(x.size());
+    fd = open(path, O_RDONLY);
+    ssize_t got = MinMaxHeapAux::__read_full(fd, y.data(), bytes);
+    close(fd);
+    TopK<double, long long> tk(k);
+    tk.Scan(y.data(), (int) (got / sizeof(double)));
+    check(tk.Emit(xk.data(), ik.data()), false);
+  }
+  fclk_timestamp(&__toc);
+  double gbs_vec = bytes / fclk_delta_timestamps(&__tic, &__toc) * 1.0e-9;
+
+  double gbs[2];
+  for (int m = 0; m < 2; m++) {
+    MinMaxHeapFile::Method method = (m == 0) ? MinMaxHeapFile::Mmap : MinMaxHeapFile::Read;
+    fclk_timestamp(&__tic);
+    check(KSmallestFile(path, k, xk.data(), ik.data(), method), false);
+    fclk_timestamp(&__toc);
+    gbs[m] = bytes / fclk_delta_timestamps(&__tic, &__toc) * 1.0e-9;
+    // small chunks, so that the window/buffer boundaries are crossed
+    TopK<double, long long> tk(k, true);
+    if (ScanFile(tk, path, method, 1 << 16) != (long long) x.size()) numerr++;
+    check(tk.Emit(xk.data(), ik.data()), true);
+    // and an oversized chunk, clamped to what one Scan call can take
+    TopK<double, long long> tb(k);
+    if (ScanFile(tb, path, method, (std::size_t) -1) != (long long) x.size()) numerr++;
+    check(tb.Emit(xk.data(), ik.data()), false);
+  }
+  unlink(path);
+
+  std::cout << "file[" << (bytes >> 20) << " MB, k=" << k << "]: read() into vector "
+            << gbs_vec << ", ScanFile mmap " << gbs[0] << ", ScanFile read " << gbs[1]
+            << " GB/s" << std::endl;
+  if (numerr != 0) {
+    std::cout << "file: " << numerr << " mismatches" << std::endl;
+  }
+  return numerr;
+}
+
+/* Snapshot of an n-element heap: replaying x into a new heap against
+   Save/Load and MapReadOnly; the restored heaps must drain like the
+   original, a d-ary heap loads a binary snapshot by rebuilding it, and a
+   flipped bit or a wrong element type is rejected. Returns the number of
+   mismatches. */
+
+int time_snapshot(const std::vector<double>& x)
+{
+  fclk_timespec __tic, __toc;
+  int n = x.size();
+  char path[] = "/tmp/mmheap-test-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    std::cout << "snapshot: cannot create " << path << std::endl;
+    return 0;
+  }
+  close(fd);
+
+  fclk_timestamp(&__tic);
+  MinMaxHeap<double, int> a(n);
+  for (int i = 0; i < n; i++) a.Insert(x[i], i);
+  fclk_timestamp(&__toc);
+  double ms_replay = fclk_delta_timestamps(&__tic, &__toc) * 1.0e3;
+
+  fclk_timestamp(&__tic);
+  bool saved = a.Save(path);
+  fclk_timestamp(&__toc);
+  double ms_save = fclk_delta_timestamps(&__tic, &__toc) * 1.0e3;
+
+  MinMaxHeap<double, int> b(1);
+  fclk_timestamp(&__tic);
+  bool loaded = b.Load(path);
+  fclk_timestamp(&__toc);
+  double ms_load = fclk_delta_timestamps(&__tic, &__toc) * 1.0e3;
+
+  MappedMinMaxHeap<double, int> m;
+  fclk_timestamp(&__tic);
+  bool mapped = m.MapReadOnly(path, false);
+  double v0 = 0.0, v1 = 0.0;
+  int j0 = -1, j1 = -1;
+  m.PeekMaxValue(&v1);
+  m.PeekMaxIndex(&j1);
+  fclk_timestamp(&__toc);
+  double ms_map = fclk_delta_timestamps(&__tic, &__toc) * 1.0e3;
+  fclk_timestamp(&__tic);
+  mapped = m.MapReadOnly(path) && mapped;
+  fclk_timestamp(&__toc);
+  double ms_verify = fclk_delta_timestamps(&__tic, &__toc) * 1.0e3;
+
+  std::cout << "snapshot[" << n << "]: replay " << ms_replay << " ms, Save " << ms_save
+            << " ms, Load " << ms_load << " ms, MapReadOnly " << ms_map << " ms ("
+            << ms_verify << " ms with checksum)" << std::endl;
+
+  int numerr = (saved && loaded && mapped && b.Length() == n && m.Length() == n) ? 0 : 1;
+  a.PeekMaxValue(&v0);
+  a.PeekMaxIndex(&j0);
+  if (v0 != v1 || j0 != j1) numerr++;
+  for (int p = 0; p < m.Length(); p++) {
+    if (m.Values()[p] != x[m.Indices()[p]]) numerr++;
+  }
+  m.Unmap();
+
+  MinMaxHeap<double, int, MinMaxHeapLayout::Blocked, 4> d(1);
+  if (!d.Load(path)) numerr++;
+  std::vector<double> xs(x), xa(n), xd(n);
+  std::vector<int> ia(n), ib(n);
+  std::sort(xs.begin(), xs.end());
+  a.DrainAscending(xa.data(), ia.data());
+  b.DrainAscending(xd.data(), ib.data());
+  for (int i = 0; i < n; i++) {
+    if (xa[i] != xs[i] || xd[i] != xs[i] || ia[i] != ib[i]) numerr++;
+  }
+  d.DrainAscending(xd.data(), ib.data());
+  for (int i = 0; i < n; i++) {
+    if (xd[i] != xs[i] || x[ib[i]] != xd[i]) numerr++;
+  }
+
+  // Save goes through path.tmp; when that cannot be written, the old
+  // snapshot stays intact
+  std::string tmp = std::string(path) + ".tmp";
+  if (::access(tmp.c_str(), F_OK) == 0) numerr++;
+  if (::mkdir(tmp.c_str(), 0700) == 0) {
+    if (d.Save(path) || !b.Load(path) || b.Length() != n) numerr++;
+    ::rmdir(tmp.c_str());
+  }
+  b.Clear();
+
+  // a flipped bit in the middle of the value section
+  std::FILE *f = std::fopen(path, "r+b");
+  std::fseek(f, 64 + sizeof(double) * (n / 2), SEEK_SET);
+  int c = std::fgetc(f);
+  std::fseek(f, 64 + sizeof(double) * (n / 2), SEEK_SET);
+  std::fputc(c ^ 1, f);
+  std::fclose(f);
+  MinMaxHeap<float, int> e(1);
+  if (b.Load(path) || b.Length() != 0 || m.MapReadOnly(path) || d.Load(path) || e.Load(path)) numerr++;
+
+  // a header claiming INT_MAX elements in a 64-byte file is refused
+  // before anything is allocated
+  std::int32_t big = 0x7fffffff;
+  f = (b.Save(path) ? std::fopen(path, "r+b") : nullptr);
+  if (f != nullptr) {
+    std::fseek(f, 16, SEEK_SET);
+    std::fwrite(&big, sizeof(big), 1, f);
+    std::fwrite(&big, sizeof(big), 1, f);
+    std::fclose(f);
+  }
+  if (f == nullptr || b.Load(path) || m.MapReadOnly(path)) numerr++;
+
+  // the growable mode travels with the snapshot
+  MinMaxHeap<double, int> g(4, true);
+  for (int i = 0; i < n; i++) g.Insert(x[i], i);
+  if (!g.Save(path) || !b.Load(path) || !b.Growable() || b.Length() != n
+      || !a.Save(path) || !g.Load(path) || g.Growable()) numerr++;
+
+  // so does a heap of capacity 0 (moved from); it loads back with capacity 1
+  MinMaxHeap<double, int> h0(std::move(g));
+  if (!g.Save(path) || !b.Load(path) || b.Length() != 0 || b.MaxLength() != 1) numerr++;
+
+  // a mapped keys-only 4-ary snapshot peeks the same extremes as the heap
+  MinMaxHeap<double, void, MinMaxHeapLayout::Split, 4> q(x.data(), nullptr, n);
+  MappedMinMaxHeap<double, void, 4> mq;
+  double q0 = 0.0, q1 = 0.0;
+  if (!q.Save(path) || !mq.MapReadOnly(path) || !mq.PeekMaxValue(&v1) || !q.PeekMaxValue(&v0) || v0 != v1
+      || !mq.PeekMinValue(&q1) || !q.PeekMinValue(&q0) || q0 != q1 || v1 != xs[n - 1] || q1 != xs[0]) numerr++;
+  mq.Unmap();
+  std::remove(path);
+
+  if (numerr != 0) {
+    std::cout << "snapshot: " << numerr << " mismatches" << std::endl;
+  }
+  return numerr;
+}
+
+/* k smallest of x through InsertOrEvictMax with the Count instrumentation
+   policy against the default (None): same result, the counters add up,
+   and the cost of counting; returns the number of mismatches. */
+
+template <class H>
+double run_stats(H& h, const std::vector<double>& x)
+{
+  fclk_timespec __tic, __toc;
+  double ev;
+  int ei;
+  fclk_timestamp(&__tic);
+  for (int i = 0; i < (int) x.size(); i++) h.InsertOrEvictMax(x[i], i, &ev, &ei);
+  fclk_timestamp(&__toc);
+  return fclk_delta_timestamps(&__tic, &__toc) * 1.0e3;
+}
+
+template <class H>
+int check_stats(const H& h, const std::vector<double>& x, int k, const char *label)
+{
+  MinMaxHeapStats::Snapshot st = h.Stats();
+  int n = x.size();
+  int m = (n < k) ? n : k;
+  int depth = 0;
+  while ((1 << depth) <= m) depth++;  // levels of a binary heap of m elements
+  std::cout << "stats[" << label << "]: compares/elem " << (double) st.compares / n
+            << ", moves/elem " << (double) st.moves / n
+            << ", bubble up " << st.bubble_ups << " x " << (double) st.bubble_steps / (st.bubble_ups ? st.bubble_ups : 1)
+            << " (max " << st.bubble_max << ")"
+            << ", trickle down " << st.trickle_downs << " x " << (double) st.trickle_steps / (st.trickle_downs ? st.trickle_downs : 1)
+            << " (max " << st.trickle_max << ")"
+            << ", rejects " << st.rejects << ", evictions " << st.evictions << std::endl;
+  int numerr = 0;
+  if (st.bubble_ups != (unsigned long long) m || st.trickle_downs != st.evictions) numerr++;
+  if (st.rejects + st.evictions != (unsigned long long) (n - m)) numerr++;
+  if (st.moves < st.bubble_steps + st.trickle_steps || st.compares < st.bubble_ups - 1 + st.trickle_downs) numerr++;
+  if (st.bubble_max > (unsigned long long) depth || st.trickle_max > (unsigned long long) depth) numerr++;
+  return numerr;
+}
+
+int time_stats(const std::vector<double>& x, int k)
+{
+  typedef MinMaxHeap<double, int> plain;
+  typedef MinMaxHeap<double, int, MinMaxHeapLayout::Split, 2, MinMaxHeapAlloc::New, MinMaxHeapStats::Count> counted;
+  typedef MinMaxHeap<double, int, MinMaxHeapLayout::Blocked, 4, MinMaxHeapAlloc::New, MinMaxHeapStats::Count> counted4;
+  plain a(k);
+  counted b(k);
+  counted4 c(k);
+  double ms_none = run_stats(a, x);
+  double ms_count = run_stats(b, x);
+  run_stats(c, x);
+  std::cout << "stats[k=" << k << "]: InsertOrEvictMax " << ms_none << " ms (None), "
+            << ms_count << " ms (Count)" << std::endl;
+
+  int numerr = check_stats(b, x, k, "D=2");
+  numerr += check_stats(c, x, k, "D=4");
+  MinMaxHeapStats::Snapshot z = a.Stats();
+  if (z.compares != 0 || z.moves != 0 || z.rejects != 0 || z.evictions != 0) numerr++;
+
+  int m = a.Length();
+  std::vector<double> xa(m), xb(m), xc(m);
+  std::vector<int> ia(m), ib(m), ic(m);
+  a.DrainAscending(xa.data(), ia.data());
+  b.DrainAscending(xb.data(), ib.data());
+  c.DrainAscending(xc.data(), ic.data());
+  if (xa != xb || ia != ib || xa != xc) numerr++;
+
+  // Insert into a full heap is a reject; ResetStats clears everything
+  b.ResetStats();
+  for (int j = 0; j <= k; j++) b.Insert(x[j % x.size()], j);
+  if (b.Stats().rejects != 1 || b.Stats().bubble_ups != (unsigned long long) k) numerr++;
+  AddressableMinMaxHeap<double, int, MinMaxHeapLayout::Split, 2, MinMaxHeapStats::Count> d(1, 2);
+  d.Insert(1.0, 0);
+  d.Insert(2.0, 1);
+  if (d.Stats().rejects != 1) numerr++;
+  if (numerr != 0) {
+    std::cout << "stats: " << numerr << " mismatches" << std::endl;
+  }
+  return numerr;
+}
+
+/* Per-operation latency with the tick timer (less its own overhead): k
+   Inserts, k ReplaceMax, then RemoveMin/RemoveMax (half each), every call
+   timed into a histogram; checks the histogram percentiles against the exact ones of
+   the same samples. Returns the number of mismatches. */
+
+int time_latency(const std::vector<double>& x, int k)
+{
+  const char *names[] = { "Insert", "ReplaceMax", "RemoveMin", "RemoveMax" };
+  std::vector<fclk_histogram> hist(4);
+  std::vector<std::vector<unsigned long long> > t(4);
+  for (int o = 0; o < 4; o++) fclk_histogram_clear(&hist[o]);
+  int n = x.size();
+  unsigned long long ovh = fclk_ticks_overhead();
+  MinMaxHeap<double, int> h(k);
+  for (int i = 0; i < 2 * k; i++) {
+    double v = x[i % n];
+    unsigned long long t0 = fclk_ticks();
+    if (i < k) h.Insert(v, i); else h.ReplaceMax(v, i);
+    unsigned long long dt = fclk_ticks_end() - t0;
+    t[i < k ? 0 : 1].push_back(dt > ovh ? dt - ovh : 0);
+  }
+  for (int i = 0; i < k; i++) {
+    unsigned long long t0 = fclk_ticks();
+    if (i < k / 2) h.RemoveMin(); else h.RemoveMax();
+    unsigned long long dt = fclk_ticks_end() - t0;
+    t[i < k / 2 ? 2 : 3].push_back(dt > ovh ? dt - ovh : 0);
+  }
+
+  int numerr = 0;
+  double qs[] = { 50.0, 99.0, 99.9, 100.0 };
+  for (int o = 0; o < 4; o++) {
+    for (unsigned long long v : t[o]) fclk_histogram_add(&hist[o], v);
+    std::sort(t[o].begin(), t[o].end());
+    std::cout << "latency[k=" << k << "]: " << names[o];
+    for (double q : qs) {
+      unsigned long long e = fclk_histogram_percentile(&hist[o], q);
+      std::cout << (q == 100.0 ? " max " : (q == 99.9 ? " p99.9 " : (q == 99.0 ? " p99 " : " p50 ")))
+                << fclk_ticks_to_ns((double) e) << " ns";
+      if (t[o].empty()) continue;
+      // exact: the ceil(q/100 n)-th smallest; the bucket keeps it to 1/32
+      std::size_t r = (std::size_t) std::ceil(q / 100.0 * t[o].size());
+      unsigned long long v = t[o][(r < 1 ? 1 : r) - 1];
+      if (e < v || e > v + v / 32) numerr++;
+    }
+    std::cout << std::endl;
+  }
+  if (numerr != 0) {
+    std::cout << "latency: " << numerr << " mismatches" << std::endl;
+  }
+  return numerr;
+}
+
 int main(int argc, char **argv)
 {
   if (argc != 3) {
@@ -36,6 +1198,7 @@ int main(int argc, char **argv)
   }
 
   fclk_timespec __tic, __toc;
+  fclk_ticks_calibrate();
 
   /* First generate n-vector of random doubles using the Mersenne Twister */
   std::mt19937 RandomGenerator;
@@ -62,6 +1225,9 @@ int main(int argc, char **argv)
 
   double tmp = 0.0;
 
+  fclk_counters pc;
+  fclk_counters_open(&pc);
+  fclk_counters_start(&pc);
   fclk_timestamp(&__tic);
   for (int i = 0; i < n; i++) {
 
@@ -69,8 +1235,7 @@ int main(int argc, char **argv)
     if (ksmall.Length() == ksmall.MaxLength()) {
       ksmall.PeekMaxValue(&tmp);
       if (x[i] < tmp) {
-        ksmall.RemoveMax();
-        ksmall.Insert(x[i], i);
+        ksmall.ReplaceMax(x[i], i);
       }
     } else {
       ksmall.Insert(x[i], i);
@@ -80,8 +1245,7 @@ int main(int argc, char **argv)
     if (klarge.Length() == klarge.MaxLength()) {
       klarge.PeekMinValue(&tmp);
       if (x[i] > tmp) {
-        klarge.RemoveMin();
-        klarge.Insert(x[i], i);
+        klarge.ReplaceMin(x[i], i);
       }
     } else {
       klarge.Insert(x[i], i);
@@ -89,8 +1253,142 @@ int main(int argc, char **argv)
     
   }
   fclk_timestamp(&__toc);
+  fclk_counters_stop(&pc);
+  fclk_counters_close(&pc);
   double elap_ksort = fclk_delta_timestamps(&__tic, &__toc);
   std::cout << "2x ksort() took " << elap_ksort * 1.0e6 << " us" << std::endl;
+  print_counters(pc, n, "2x ksort");
+
+  /* Same selection with the TopK engine (includes the sorted output stage) */
+  std::vector<double> xs(k), xl(k);
+  std::vector<int> is(k), il(k);
+
+  fclk_timestamp(&__tic);
+  KSmallest<double, int>(x.data(), n, k, xs.data(), is.data());
+  KLargest<double, int>(x.data(), n, k, xl.data(), il.data());
+  fclk_timestamp(&__toc);
+  double elap_topk = fclk_delta_timestamps(&__tic, &__toc);
+  std::cout << "2x TopK took " << elap_topk * 1.0e6 << " us" << std::endl;
+
+  /* And with std::partial_sort on a copy of the vector (k-smallest only) */
+  std::vector<double> xp(x);
+  fclk_timestamp(&__tic);
+  std::partial_sort(xp.begin(), xp.begin() + k, xp.end());
+  fclk_timestamp(&__toc);
+  double elap_psort = fclk_delta_timestamps(&__tic, &__toc);
+  std::cout << "std::partial_sort() took " << elap_psort * 1.0e6 << " us" << std::endl;
+
+  int numerr = 0;
+
+  for (int i = 0; i < k; i++) {
+    if (x[is[i]] != xs[i] || x[il[i]] != xl[i]) {
+      std::cout << "index error at position " << i << " (TopK)" << std::endl;
+      numerr++;
+    }
+  }
+
+  /* k = 0 selects nothing and writes nothing */
+  {
+    double x0 = -1.0;
+    int i0 = -1;
+    TopK<double, int> t0(0);
+    t0.Scan(x.data(), n);
+    t0.Push(0.0, n);
+    if (KSmallest<double, int>(x.data(), n, 0, &x0, &i0) != 0 || KLargest<double, int>(x.data(), n, 0, &x0, &i0) != 0
+        || t0.Emit(&x0, &i0) != 0 || t0.Count() != n + 1 || t0.K() != 0 || t0.Threshold(&x0) || x0 != -1.0 || i0 != -1) {
+      std::cout << "k = 0 selection wrote output" << std::endl;
+      numerr++;
+    }
+    WindowTopK<double, int> w0(0, 16), w0l(0, 16, true);
+    w0.Scan(x.data(), n);
+    w0l.Scan(x.data(), n);
+    if (w0.Emit(&x0, &i0) != 0 || w0l.Emit(&x0, &i0) != 0 || w0.Count() != n || w0.K() != 0 || w0.Length() != 0
+        || w0.Threshold(&x0) || w0.PeekMinValue(&x0) || w0l.PeekMaxIndex(&i0) || x0 != -1.0 || i0 != -1) {
+      std::cout << "k = 0 window selection wrote output" << std::endl;
+      numerr++;
+    }
+  }
+
+  /* Multi-threaded selection; scaling over 1, 2, 4, ... hardware threads */
+  int maxthreads = std::thread::hardware_concurrency();
+  if (maxthreads < 1) maxthreads = 1;
+  std::vector<double> xpk(k);
+  std::vector<int> ipk(k);
+  std::vector<double> xdesc(x);  // reference for ParallelKLargest
+  std::sort(xdesc.begin(), xdesc.end(), std::greater<double>());
+  for (int t = 1; ; t = (2 * t < maxthreads ? 2 * t : maxthreads)) {
+    fclk_timestamp(&__tic);
+    ParallelKSmallest<double, int>(x.data(), n, k, xpk.data(), ipk.data(), t);
+    fclk_timestamp(&__toc);
+    double elap_par = fclk_delta_timestamps(&__tic, &__toc);
+    std::cout << "ParallelKSmallest(" << t << " threads) took " << elap_par * 1.0e6 << " us" << std::endl;
+    for (int i = 0; i < k; i++) {
+      if (xpk[i] != xs[i] || x[ipk[i]] != xs[i]) {
+        std::cout << "parallel error at position " << i << " (" << t << " threads)" << std::endl;
+        numerr++;
+        break;
+      }
+    }
+    int nl = ParallelKLargest<double, int>(x.data(), n, k, xpk.data(), ipk.data(), t);
+    for (int i = 0; i < k; i++) {
+      if (nl != k || xpk[i] != xdesc[i] || x[ipk[i]] != xdesc[i]) {
+        std::cout << "parallel largest error at position " << i << " (" << t << " threads)" << std::endl;
+        numerr++;
+        break;
+      }
+    }
+    if (ParallelKSmallest<double, int>(x.data(), n, 0, xpk.data(), ipk.data(), t) != 0
+        || ParallelKLargest<double, int>(x.data(), n, 0, xpk.data(), ipk.data(), t) != 0) {
+      std::cout << "parallel k = 0 selection returned elements (" << t << " threads)" << std::endl;
+      numerr++;
+    }
+    if (t == maxthreads) break;
+  }
+
+  /* Storage layouts at capacity k; x is still in random order */
+  time_layouts<double, int>(x, k, 1.0, "double/int");
+  time_layouts<float, int>(x, k, 1.0, "float/int");
+  time_layouts<long long, long long>(x, k, 1099511627776.0, "int64/int64");
+  numerr += check_layouts(x, k);
+
+  /* Binary vs 4-ary and 8-ary min-max heaps at capacity k */
+  std::cout << "arity[double/int, k=" << k << "]: D=2 "
+            << time_layout<double, int, MinMaxHeapLayout::Split, 2>(x, k) << " ns, D=4 "
+            << time_layout<double, int, MinMaxHeapLayout::Split, 4>(x, k) << " ns, D=4 Blocked "
+            << time_layout<double, int, MinMaxHeapLayout::Blocked, 4>(x, k) << " ns, D=8 Blocked "
+            << time_layout<double, int, MinMaxHeapLayout::Blocked, 8>(x, k) << " ns" << std::endl;
+
+  /* Packed 64-bit (value, index) keys vs split float/int arrays */
+  {
+    std::vector<float> xf(x.begin(), x.begin() + k);
+    std::cout << "packed[float/int, k=" << k << "]: Split "
+              << time_layout<float, int, MinMaxHeapLayout::Split>(xf, k) << " ns, Packed "
+              << time_layout<float, int, MinMaxHeapLayout::Packed>(xf, k) << " ns, Packed D=4 "
+              << time_layout<float, int, MinMaxHeapLayout::Packed, 4>(xf, k) << " ns, keys-only Packed "
+              << time_layout_keys<float, MinMaxHeapLayout::Packed>(xf, k) << " ns" << std::endl;
+  }
+
+  /* Allocator policies for short-lived heaps */
+  time_alloc_policies(x, k);
+
+  /* Non-trivial value type */
+  time_payloads(x, k);
+
+  /* Addressable heap: incremental re-prioritization */
+  numerr += time_updates(x, k);
+
+  /* O(n) bulk build */
+  numerr += time_heapify(x);
+  numerr += time_merge(x, k);
+  numerr += time_drain(x, k);
+  numerr += time_quantile(x);
+  numerr += time_window(x, k);
+  numerr += time_concurrent(x);
+  numerr += time_ingest(x, k);
+  numerr += time_file(x, k);
+  numerr += time_snapshot(x);
+  numerr += time_stats(x, k);
+  numerr += time_latency(x, k);
 
   /* Then create a sorted version of this vector using std::sort */
   fclk_timestamp(&__tic);
@@ -99,8 +1397,6 @@ int main(int argc, char **argv)
   double elap_qsort = fclk_delta_timestamps(&__tic, &__toc);
   std::cout << "std::sort() took " << elap_qsort * 1.0e6 << " us" << std::endl;
 
-  int numerr = 0;
-
   /* Finally check elementwise equivalence of the sorted results (in the expected sense)*/
   for (int i = 0; i < k; i++) {
     ksmall.PeekMinValue(&tmp);
@@ -122,6 +1418,10 @@ int main(int argc, char **argv)
       numerr++;
     }
     klarge.RemoveMax();
+    if (x[i] != xs[i] || x[j] != xl[i]) {
+      std::cout << "sorting error at position " << i << " (TopK)" << std::endl;
+      numerr++;
+    }
     if (k <= kmaxshow) {
       std::cout << "sorted x[" << j << "] = " << x[j] << " and klarge-max-" << i << " = " << tmp << std::endl;
     }
@@ -131,5 +1431,12 @@ int main(int argc, char **argv)
     std::cout << "*** All element checks passed ***" << std::endl;
   }
 
+  /* Kernel cost per operation for ascending, descending and random input */
+  time_heap_ops(x, "ascending");
+  std::reverse(x.begin(), x.end());
+  time_heap_ops(x, "descending");
+  std::shuffle(x.begin(), x.end(), RandomGenerator);
+  time_heap_ops(x, "random");
+
   return 0;
 }
@@ -3,12 +3,16 @@
  *
  * Rudimentary C++ template implementation of a min-max-heap.
  *
- * This MinMaxHeap is not dynamically allocating;
- * it is a fixed-max-size container.
+ * By default MinMaxHeap is a fixed-max-size container; it allocates
+ * once at construction and Insert fails when it is full. A heap made
+ * growable doubles its capacity instead. Storage comes from an allocator
+ * policy (see MinMaxHeapAlloc), e.g. a bump arena shared by many
+ * short-lived heaps.
  *
  * Each object in the heap has a pair of properties: ("value", "index").
  * The heap property is based on "value", and each object sorted by value
- * has an associated property "index".
+ * has an associated property "index". MinMaxHeap<V> (index type void)
+ * stores values only.
  *
  * Implementation based on original reference:
  *    Atkinson, Sack, Santoro, Strothotte,
@@ -20,7 +24,31 @@
 #ifndef __MMHEAP_H__
 #define __MMHEAP_H__
 
-/* Below aux. template programs operate on simple linear arrays */
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(MMHEAP_NO_SIMD)
+#include <immintrin.h>
+#define __MMHEAP_X86_SIMD
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>  // fsync
+#define __MMHEAP_FSYNC
+#endif
+
+/* Below aux. template programs operate on a heap store S, addressed by
+   1-based position; S::key(p) is the heap key, S::take(p) / S::put(p, e)
+   move an element out of / into a position and S::move(dst, src) moves
+   one entry (see MinMaxHeapLayout) */
 
 namespace MinMaxHeapAux
 {
@@ -30,367 +58,2592 @@ namespace MinMaxHeapAux
 // useful for checking if a level is of min- or max-type
 static inline int __msbpos(int i) {
   if (i <= 0) return 0;
+#if defined(__GNUC__)
+  return 32 - __builtin_clz((unsigned int) i);
+#else
   int r = 1;
   while (i >>= 1) r++;
   return r;
+#endif
 }
 
 // 1-based index i
 // odd level is min-level (1,3,5,...)
 // even level is max-level (2,4,6,...)
 static inline int __isminlevel(int i) {
-  if (__msbpos(i) & 1) return 1;
-  return 0;
+  return __msbpos(i) & 1;
 }
 
-template<class V, class I>
-static inline void __ab_swap(V *A, I *B, int i, int j) {
-  V tmpa = A[j];
-  A[j] = A[i];
-  A[i] = tmpa;
-  I tmpb = B[j];
-  B[j] = B[i];
-  B[i] = tmpb;
-}
+// Kernels are hole based: the element e being placed is held outside the
+// store while position i is a hole. Elements on the path move into the
+// hole, and e is put once at its final position, so each step is one
+// move instead of a pairwise swap.
 
-// bubble up is used for insertion
+// bubble up is used for insertion;
+// once the first step has picked a min- or max-level the element
+// only moves between grandparents, so the level type is fixed
 
-template<class V, class I>
-static void __bubble_up_min(V *A, I *B, int i) {
-  int grandparenti = (i >> 2);
-  if (grandparenti) {
-    if (A[i - 1] < A[grandparenti - 1]) {
-      __ab_swap<V, I>(A, B, i - 1, grandparenti - 1);
-      __bubble_up_min<V, I>(A, B, grandparenti);
-    }
+template <class S, class E>
+static inline void __bubble_up_min(S &s, int i, E &e) {
+  for (int g = i >> 2; g; g = i >> 2) {
+    s.on_compare();
+    if (!(s.key_of(e) < s.key(g))) break;
+    s.move(i, g);
+    s.on_bubble_step();
+    i = g;
   }
+  s.put(i, std::move(e));
 }
 
-template<class V, class I>
-static void __bubble_up_max(V *A, I *B, int i) {
-  int grandparenti = (i >> 2);
-  if (grandparenti) {
-    if (A[i - 1] > A[grandparenti - 1]) {
-      __ab_swap<V, I>(A, B, i - 1, grandparenti - 1);
-      __bubble_up_max<V, I>(A, B, grandparenti);
-    }
+template <class S, class E>
+static inline void __bubble_up_max(S &s, int i, E &e) {
+  for (int g = i >> 2; g; g = i >> 2) {
+    s.on_compare();
+    if (!(s.key_of(e) > s.key(g))) break;
+    s.move(i, g);
+    s.on_bubble_step();
+    i = g;
   }
+  s.put(i, std::move(e));
 }
 
-template<class V, class I>
-static void __bubble_up(V *A, I *B, int i) {
+template <class S, class E>
+static inline void __bubble_up(S &s, int i, E &e) {
   int parenti = (i >> 1);
+  if (parenti == 0) {
+    s.put(i, std::move(e));
+    return;
+  }
+  s.on_compare();
   if (__isminlevel(i)) {
-    if (parenti) {
-      if (A[i - 1] > A[parenti - 1]) {
-        __ab_swap<V, I>(A, B, i - 1, parenti - 1);
-        __bubble_up_max<V, I>(A, B, parenti);
-      } else {
-        __bubble_up_min<V, I>(A, B, i);
-      }
+    if (s.key_of(e) > s.key(parenti)) {
+      s.move(i, parenti);
+      s.on_bubble_step();
+      __bubble_up_max(s, parenti, e);
     } else {
-      __bubble_up_min<V, I>(A, B, i);
+      __bubble_up_min(s, i, e);
     }
   } else {
-    if (parenti) { 
-      if (A[i - 1] < A[parenti - 1]) {
-        __ab_swap<V, I>(A, B, i - 1, parenti - 1);
-        __bubble_up_min<V, I>(A, B, parenti);
-      } else {
-        __bubble_up_max<V, I>(A, B, i);
-      }
+    if (s.key_of(e) < s.key(parenti)) {
+      s.move(i, parenti);
+      s.on_bubble_step();
+      __bubble_up_min(s, parenti, e);
     } else {
-      __bubble_up_max<V, I>(A, B, i);
+      __bubble_up_max(s, i, e);
     }
   }
 }
 
-// trickle down is used for removal
+// e and the element at p trade places (used when e has passed a
+// grandchild and is on the wrong side of that grandchild's parent)
 
-template <class V, class I>
-static void __trickle_down_min(V *A, I *B, int i, int maxi) {
-  int m;
-  int lchild = i << 1;    // children
-  if (lchild>maxi)
-    return;  // no children at all; nothing to do
-  int rchild = lchild + 1;
-  if (rchild <= maxi) {
-    // i has two children
-    if (A[lchild - 1] < A[rchild - 1]) {
-      m = lchild;
+template <class S, class E>
+static inline void __exchange(S &s, int p, E &e) {
+  E t = s.take(p);
+  s.put(p, std::move(e));
+  e = std::move(t);
+  s.on_move();
+}
+
+// trickle down is used for removal;
+// the element moves between grandchildren so the level type is fixed.
+// When all four grandchildren exist the extreme is always one of them
+// (each child bounds its own children), and it is picked with a
+// branch-free tournament; the general scan is only needed at the bottom.
+
+template <class S, class E>
+static inline void __trickle_down_min(S &s, int i, int maxi, E &e) {
+  for (;;) {
+    int lchild = i << 1;    // children
+    int llchild = lchild << 1;  // first of four grandchildren
+    int m;
+    if (llchild + 3 <= maxi) {
+      int m1 = llchild + (s.key(llchild + 1) < s.key(llchild));
+      int m2 = llchild + 2 + (s.key(llchild + 3) < s.key(llchild + 2));
+      m = (s.key(m2) < s.key(m1)) ? m2 : m1;
+      s.on_compare(3);
     } else {
-      m = rchild;
-    }
-    // now find also grandchildren (could exist)
-    // no grandchildren exists unless there are two children
-    int llchild = lchild << 1;  // grandchildren
-    int lrchild = llchild + 1;
-    int rlchild = rchild << 1;
-    int rrchild = rlchild + 1;
-    if (llchild <= maxi) {
-      if (A[llchild - 1] < A[m - 1]) {
-        m = llchild;
+      if (lchild > maxi)
+        break;  // no children at all; nothing to do
+      m = lchild;
+      if (lchild + 1 <= maxi && s.key(lchild + 1) < s.key(lchild))
+        m = lchild + 1;
+      for (int g = llchild; g <= maxi; g++) {
+        if (s.key(g) < s.key(m)) m = g;
       }
+      s.on_compare((lchild + 1 <= maxi) + (maxi >= llchild ? maxi - llchild + 1 : 0));
     }
-    if (lrchild <= maxi) {
-      if (A[lrchild - 1] < A[m - 1]) {
-        m = lrchild;
-      }
+    // at this point m is the index of the minimum-value child or grandchild
+    s.on_compare();
+    if (!(s.key(m) < s.key_of(e)))
+      break;
+    s.move(i, m);
+    s.on_trickle_step();
+    i = m;
+    if (m < llchild)
+      break;  // m is a child (and a leaf)
+    int parentm = m >> 1;
+    s.on_compare();
+    if (s.key_of(e) > s.key(parentm)) {
+      __exchange(s, parentm, e);
     }
-    if (rlchild <= maxi) {
-      if (A[rlchild - 1] < A[m - 1]) {
-        m = rlchild;
+  }
+  s.put(i, std::move(e));
+}
+
+template <class S, class E>
+static inline void __trickle_down_max(S &s, int i, int maxi, E &e) {
+  for (;;) {
+    int lchild = i << 1;    // children
+    int llchild = lchild << 1;  // first of four grandchildren
+    int m;
+    if (llchild + 3 <= maxi) {
+      int m1 = llchild + (s.key(llchild + 1) > s.key(llchild));
+      int m2 = llchild + 2 + (s.key(llchild + 3) > s.key(llchild + 2));
+      m = (s.key(m2) > s.key(m1)) ? m2 : m1;
+      s.on_compare(3);
+    } else {
+      if (lchild > maxi)
+        break;  // no children at all; nothing to do
+      m = lchild;
+      if (lchild + 1 <= maxi && s.key(lchild + 1) > s.key(lchild))
+        m = lchild + 1;
+      for (int g = llchild; g <= maxi; g++) {
+        if (s.key(g) > s.key(m)) m = g;
       }
+      s.on_compare((lchild + 1 <= maxi) + (maxi >= llchild ? maxi - llchild + 1 : 0));
     }
-    if (rrchild <= maxi) {
-      if (A[rrchild - 1] < A[m - 1]) {
-        m = rrchild;
-      }
+    // at this point m is the index of the maximum-value child or grandchild
+    s.on_compare();
+    if (!(s.key(m) > s.key_of(e)))
+      break;
+    s.move(i, m);
+    s.on_trickle_step();
+    i = m;
+    if (m < llchild)
+      break;  // m is a child (and a leaf)
+    int parentm = m >> 1;
+    s.on_compare();
+    if (s.key_of(e) < s.key(parentm)) {
+      __exchange(s, parentm, e);
     }
+  }
+  s.put(i, std::move(e));
+}
+
+template <class S, class E>
+static inline void __trickle_down(S &s, int i, int maxi, E &e) {
+  if (__isminlevel(i)) {
+    __trickle_down_min(s, i, maxi, e);
   } else {
-    // i has only one child
-    m = lchild;
-  }
-  // at this point m is the index of the minimum-value child or grandchild
-  if (m > rchild) {
-    // m is a grandchild
-    if (A[m - 1] < A[i - 1]) {
-      __ab_swap<V, I>(A, B, i - 1, m - 1);
-      int parentm = m >> 1;
-      if (A[m - 1] > A[parentm - 1]) {
-        __ab_swap<V, I>(A, B, m - 1, parentm - 1);
-      }
-      __trickle_down_min<V, I>(A, B, m, maxi);
+    __trickle_down_max(s, i, maxi, e);
+  }
+}
+
+// d-ary min-max heap (D = 4 or 8), 1-based positions:
+// children of p are D(p-1)+2 .. D(p-1)+D+1, parent of p is (p-2)/D+1.
+// Fewer levels than the binary heap, and the D children and D*D
+// grandchildren of a node are contiguous.
+
+template <int D>
+static inline int __dary_parent(int p) { return (p - 2) / D + 1; }
+
+template <int D>
+static inline int __dary_child(int p) { return D * (p - 1) + 2; }
+
+template <int D>
+static inline int __isminlevel_dary(int p) {
+  // level of 0-based j = p-1 is floor(log_D((D-1)j+1)); root (level 0) is min
+  const int b = (D == 4) ? 2 : 3;
+  unsigned long long x = (unsigned long long)(D - 1) * (unsigned long long)(p - 1) + 1;
+#if defined(__GNUC__)
+  int lg = 63 - __builtin_clzll(x);
+#else
+  int lg = 0;
+  while (x >>= 1) lg++;
+#endif
+  return ((lg / b) & 1) == 0;
+}
+
+template <int D, class S, class E>
+static inline void __dary_bubble_up_min(S &s, int i, E &e) {
+  while (i > D + 1) {
+    int g = __dary_parent<D>(__dary_parent<D>(i));
+    s.on_compare();
+    if (!(s.key_of(e) < s.key(g))) break;
+    s.move(i, g);
+    s.on_bubble_step();
+    i = g;
+  }
+  s.put(i, std::move(e));
+}
+
+template <int D, class S, class E>
+static inline void __dary_bubble_up_max(S &s, int i, E &e) {
+  while (i > D + 1) {
+    int g = __dary_parent<D>(__dary_parent<D>(i));
+    s.on_compare();
+    if (!(s.key_of(e) > s.key(g))) break;
+    s.move(i, g);
+    s.on_bubble_step();
+    i = g;
+  }
+  s.put(i, std::move(e));
+}
+
+template <int D, class S, class E>
+static inline void __dary_bubble_up(S &s, int i, E &e) {
+  if (i <= 1) {
+    s.put(i, std::move(e));
+    return;
+  }
+  int parenti = __dary_parent<D>(i);
+  s.on_compare();
+  if (__isminlevel_dary<D>(i)) {
+    if (s.key_of(e) > s.key(parenti)) {
+      s.move(i, parenti);
+      s.on_bubble_step();
+      __dary_bubble_up_max<D>(s, parenti, e);
+    } else {
+      __dary_bubble_up_min<D>(s, i, e);
     }
   } else {
-    // m is child
-    if (A[m - 1] < A[i - 1]) {
-      __ab_swap<V, I>(A, B, i - 1, m - 1);
+    if (s.key_of(e) < s.key(parenti)) {
+      s.move(i, parenti);
+      s.on_bubble_step();
+      __dary_bubble_up_min<D>(s, parenti, e);
+    } else {
+      __dary_bubble_up_max<D>(s, i, e);
     }
   }
 }
 
-template <class V, class I>
-static void __trickle_down_max(V *A, I *B, int i, int maxi) {
-  int m;
-  int lchild = i << 1;    // children
-  if (lchild > maxi)
-    return;  // no children at all; nothing to do
-  int rchild = lchild + 1;
-  if (rchild <= maxi) {
-    // i has two children
-    if (A[lchild - 1] > A[rchild - 1]) {
-      m = lchild;
+template <int D, class S, class E>
+static inline void __dary_trickle_down_min(S &s, int i, int maxi, E &e) {
+  for (;;) {
+    int c = __dary_child<D>(i);    // first child
+    if (c > maxi)
+      break;  // no children at all; nothing to do
+    int g = __dary_child<D>(c);    // first grandchild
+    int m;
+    if (g + D * D - 1 <= maxi) {
+      // all grandchildren exist; the min is one of them
+      const typename S::key_type *km = &s.key(g);
+      m = g;
+      for (int q = g + 1; q < g + D * D; q++) {
+        const typename S::key_type *kq = &s.key(q);
+        bool b = (*kq < *km);
+        km = b ? kq : km;
+        m = b ? q : m;
+      }
+      s.on_compare(D * D - 1);
     } else {
-      m = rchild;
-    }
-    // now find also grandchildren (could exist)
-    // no grandchildren exists unless there are two children
-    int llchild = lchild << 1;  // grandchildren
-    int lrchild = llchild + 1;
-    int rlchild = rchild << 1;
-    int rrchild = rlchild + 1;
-    if (llchild <= maxi) {
-      if (A[llchild - 1] > A[m - 1]) {
-        m = llchild;
+      m = c;
+      int ce = (c + D - 1 < maxi) ? c + D - 1 : maxi;
+      for (int q = c + 1; q <= ce; q++) {
+        if (s.key(q) < s.key(m)) m = q;
       }
-    }
-    if (lrchild <= maxi) {
-      if (A[lrchild - 1] > A[m - 1]) {
-        m = lrchild;
+      for (int q = g; q <= maxi; q++) {
+        if (s.key(q) < s.key(m)) m = q;
       }
+      s.on_compare(ce - c + (maxi >= g ? maxi - g + 1 : 0));
     }
-    if (rlchild <= maxi) {
-      if (A[rlchild - 1] > A[m - 1]) {
-        m = rlchild;
-      }
+    s.on_compare();
+    if (!(s.key(m) < s.key_of(e)))
+      break;
+    s.move(i, m);
+    s.on_trickle_step();
+    i = m;
+    if (m < g)
+      break;  // m is a child (and a leaf)
+    int parentm = __dary_parent<D>(m);
+    s.on_compare();
+    if (s.key_of(e) > s.key(parentm)) {
+      __exchange(s, parentm, e);
     }
-    if (rrchild <= maxi) {
-      if (A[rrchild - 1] > A[m - 1]) {
-        m = rrchild;
+  }
+  s.put(i, std::move(e));
+}
+
+template <int D, class S, class E>
+static inline void __dary_trickle_down_max(S &s, int i, int maxi, E &e) {
+  for (;;) {
+    int c = __dary_child<D>(i);    // first child
+    if (c > maxi)
+      break;  // no children at all; nothing to do
+    int g = __dary_child<D>(c);    // first grandchild
+    int m;
+    if (g + D * D - 1 <= maxi) {
+      // all grandchildren exist; the max is one of them
+      const typename S::key_type *km = &s.key(g);
+      m = g;
+      for (int q = g + 1; q < g + D * D; q++) {
+        const typename S::key_type *kq = &s.key(q);
+        bool b = (*kq > *km);
+        km = b ? kq : km;
+        m = b ? q : m;
       }
-    }
-  } else {
-    // i has only one child
-    m = lchild;
-  }
-  
-  // at this point m is the index of the maximum-value child or grandchild
-  if (m > rchild) {
-    // m is a grandchild
-    if (A[m - 1] > A[i - 1]) {
-      __ab_swap<V, I>(A, B, i - 1, m - 1);
-      int parentm = m >> 1;
-      if (A[m - 1] < A[parentm - 1]) {
-        __ab_swap<V, I>(A, B, m - 1, parentm - 1);
+      s.on_compare(D * D - 1);
+    } else {
+      m = c;
+      int ce = (c + D - 1 < maxi) ? c + D - 1 : maxi;
+      for (int q = c + 1; q <= ce; q++) {
+        if (s.key(q) > s.key(m)) m = q;
+      }
+      for (int q = g; q <= maxi; q++) {
+        if (s.key(q) > s.key(m)) m = q;
       }
-      __trickle_down_max<V, I>(A, B, m, maxi);
+      s.on_compare(ce - c + (maxi >= g ? maxi - g + 1 : 0));
     }
-  } else {
-    // m is child
-    if (A[m - 1] > A[i - 1]) {
-      __ab_swap<V, I>(A, B, i - 1, m - 1);
+    s.on_compare();
+    if (!(s.key(m) > s.key_of(e)))
+      break;
+    s.move(i, m);
+    s.on_trickle_step();
+    i = m;
+    if (m < g)
+      break;  // m is a child (and a leaf)
+    int parentm = __dary_parent<D>(m);
+    s.on_compare();
+    if (s.key_of(e) < s.key(parentm)) {
+      __exchange(s, parentm, e);
     }
   }
+  s.put(i, std::move(e));
 }
 
-template <class V, class I>
-static void __trickle_down(V *A, I *B, int i, int maxi) {
-  if (__isminlevel(i)) {
-    __trickle_down_min<V, I>(A, B, i, maxi);
+// arity dispatch used by MinMaxHeap; D = 2 is the binary heap above
+
+template <int D, class S, class E>
+static inline void __bubble_up(S &s, int i, E &e) {
+  s.on_bubble();
+  if (D == 2) {
+    __bubble_up(s, i, e);
   } else {
-    __trickle_down_max<V, I>(A, B, i, maxi);
+    __dary_bubble_up<D>(s, i, e);
   }
 }
 
-} // end aux. namespace
-
-template <class V, class I>
-class MinMaxHeap
-{
-public:
-  MinMaxHeap(int m) {
-    if (m <= 0) m = 1; // Construct something valid always
-    value = new V [m];
-    index = new I [m];
-    maxlength = m;
-    length = 0;
+template <int D, class S, class E>
+static inline void __trickle_down(S &s, int i, int maxi, E &e) {
+  s.on_trickle();
+  if (D == 2) {
+    __trickle_down(s, i, maxi, e);
+  } else if (__isminlevel_dary<D>(i)) {
+    __dary_trickle_down_min<D>(s, i, maxi, e);
+  } else {
+    __dary_trickle_down_max<D>(s, i, maxi, e);
   }
+}
 
-  MinMaxHeap(const MinMaxHeap& c) {
-    int m = c.MaxLength();
-    value = new V [m];
-    index = new I [m];
-    maxlength = m;
-    int l = c.Length();
-    for (int i = 0; i < l; i++) {
-      value[i] = c.value[i];
-      index[i] = c.index[i];
+// e goes into hole i of a heap of maxi elements, where the old element
+// at i had any value (update or erase of an inner element). If e belongs
+// above its parent's level it takes the parent's place and continues up,
+// and the parent's element trickles down from i instead; if it belongs
+// above its grandparent it bubbles up; otherwise it trickles down.
+
+template <int D, class S, class E>
+static inline void __sift(S &s, int i, int maxi, E &e) {
+  if (i > 1) {
+    int q = (D == 2) ? (i >> 1) : __dary_parent<D>(i);
+    int g = (q > 1) ? ((D == 2) ? (q >> 1) : __dary_parent<D>(q)) : 0;
+    bool minlevel = (D == 2) ? __isminlevel(i) : __isminlevel_dary<D>(i);
+    s.on_compare();
+    if (minlevel ? s.key_of(e) > s.key(q) : s.key_of(e) < s.key(q)) {
+      E t = s.take(q);
+      s.on_bubble();
+      s.on_bubble_step();  // e takes q's place
+      if (D == 2) {
+        if (minlevel) __bubble_up_max(s, q, e); else __bubble_up_min(s, q, e);
+      } else {
+        if (minlevel) __dary_bubble_up_max<D>(s, q, e); else __dary_bubble_up_min<D>(s, q, e);
+      }
+      __trickle_down<D>(s, i, maxi, t);
+      return;
+    }
+    if (g != 0) s.on_compare();
+    if (g != 0 && (minlevel ? s.key_of(e) < s.key(g) : s.key_of(e) > s.key(g))) {
+      s.on_bubble();
+      if (D == 2) {
+        if (minlevel) __bubble_up_min(s, i, e); else __bubble_up_max(s, i, e);
+      } else {
+        if (minlevel) __dary_bubble_up_min<D>(s, i, e); else __dary_bubble_up_max<D>(s, i, e);
+      }
+      return;
     }
-    length = l;
   }
+  __trickle_down<D>(s, i, maxi, e);
+}
 
-  ~MinMaxHeap() {
-    delete[] value;
-    delete[] index;
+// 1-based position of the max element of a heap of length n > 0 (the
+// root or one of its children); shared by MinMaxHeap and
+// AddressableMinMaxHeap, as are the peeks below
+
+template <int D, class S>
+static inline int __maxpos(const S &s, int n) {
+  if (n <= 2) return n;
+  if (D == 2) return (s.key(2) >= s.key(3)) ? 2 : 3;
+  int m = 2;
+  int ce = (D + 1 < n) ? D + 1 : n;
+  for (int p = 3; p <= ce; p++) {
+    if (s.key(p) > s.key(m)) m = p;
   }
+  return m;
+}
 
-  int Length() const { return length; }
-  int MaxLength() const { return maxlength; }
+// value or index of the min (max) element; false if n == 0 or out is nullptr
 
-  /* O(1) peek operations */
+template <int D, class S, class V>
+static inline bool __peek_value(const S &s, int n, bool max, V *v) {
+  if (n == 0 || v == nullptr) return false;
+  *v = s.value_at(max ? __maxpos<D>(s, n) : 1);
+  return true;
+}
 
-  bool PeekMinValue(V *v) const {
-    if (length == 0 || v == nullptr) return false;
-    *v = value[0];
-    return true;
+template <int D, class S, class I>
+static inline bool __peek_index(const S &s, int n, bool max, I *i) {
+  if (n == 0 || i == nullptr) return false;
+  *i = s.index_at(max ? __maxpos<D>(s, n) : 1);
+  return true;
+}
+
+// store adaptor that moves every position up by K slots; with K = D-2
+// the children of p start at slot D*p, so sibling groups (and grandchild
+// groups) are aligned in the Blocked layout. It also carries the
+// instrumentation policy T (see MinMaxHeapStats), whose hooks the kernels
+// call through the store.
+
+template <class S, int K, class T>
+struct __shifted : S, T
+{
+  template <class A>
+  bool Allocate(A& a, int m) { return S::Allocate(a, m + K); }
+  template <class A>
+  void Release(A& a, int m) { S::Release(a, m + K); }
+  const typename S::key_type& key(int p) const { return S::key(p + K); }
+  auto value_at(int p) const -> decltype(S::value_at(p)) { return S::value_at(p + K); }
+  auto index_at(int p) const -> decltype(S::index_at(p)) { return S::index_at(p + K); }
+  template <class V, class I>
+  void set(int p, const V& v, const I& i) { S::set(p + K, v, i); }
+  typename S::elem_type take(int p) { return S::take(p + K); }
+  void put(int p, typename S::elem_type&& e) { S::put(p + K, std::move(e)); }
+  void move(int dst, int src) { S::move(dst + K, src + K); }
+  void swap(int p, int q) { S::swap(p + K, q + K); }
+  // the counters of T go along with the elements
+  void copy_from(const __shifted& c, int n) { S::copy_from(c, n + K); T::operator=(c); }
+  void move_from(__shifted& c, int n) { S::move_from(c, n + K); T::operator=(c); }
+};
+
+// store adaptor that keeps pos[index] = heap position for every element
+// (0 if absent); indices are integers in [0, n)
+
+template <class S>
+struct __tracked : S
+{
+  int *pos;
+
+  void put(int p, typename S::elem_type&& e) {
+    S::put(p, std::move(e));
+    pos[S::index_at(p)] = p;
+  }
+  void move(int dst, int src) {
+    S::move(dst, src);
+    pos[S::index_at(dst)] = dst;
   }
+  void swap(int p, int q) {
+    S::swap(p, q);
+    pos[S::index_at(p)] = p;
+    pos[S::index_at(q)] = q;
+  }
+};
+
+// threshold prefilter for top-k scans:
+// returns the position of the first x[j] below t (Above = false)
+// or above t (Above = true), or n if there is no such element.
+// double and float arrays use SSE2/AVX when available.
+
+template <bool Above, class T, class V>
+static inline std::ptrdiff_t __scan_scalar(const T *x, std::ptrdiff_t n, const V &t) {
+  std::ptrdiff_t j = 0;
+  if (Above) {
+    while (j < n && !(x[j] > t)) j++;
+  } else {
+    while (j < n && !(x[j] < t)) j++;
+  }
+  return j;
+}
+
+#ifdef __MMHEAP_X86_SIMD
 
-  bool PeekMaxValue(V *v) const {
-    if (length == 0 || v == nullptr) return false;
-    if (length == 1) {
-      *v = value[0];
-    } else if (length == 2) {
-      *v = value[1];
+template <bool Above>
+__attribute__((target("sse2")))
+static std::ptrdiff_t __scan_sse2(const double *x, std::ptrdiff_t n, double t) {
+  const __m128d vt = _mm_set1_pd(t);
+  std::ptrdiff_t j = 0;
+  for (; j + 8 <= n; j += 8) {
+    __m128d a = _mm_loadu_pd(x + j);
+    __m128d b = _mm_loadu_pd(x + j + 2);
+    __m128d c = _mm_loadu_pd(x + j + 4);
+    __m128d d = _mm_loadu_pd(x + j + 6);
+    if (Above) {
+      a = _mm_cmpgt_pd(a, vt); b = _mm_cmpgt_pd(b, vt);
+      c = _mm_cmpgt_pd(c, vt); d = _mm_cmpgt_pd(d, vt);
     } else {
-      if (value[1] >= value[2]) {
-        *v = value[1];
-      } else {
-        *v = value[2];
-      }
+      a = _mm_cmplt_pd(a, vt); b = _mm_cmplt_pd(b, vt);
+      c = _mm_cmplt_pd(c, vt); d = _mm_cmplt_pd(d, vt);
     }
-    return true;
+    int m = _mm_movemask_pd(a) | (_mm_movemask_pd(b) << 2) |
+            (_mm_movemask_pd(c) << 4) | (_mm_movemask_pd(d) << 6);
+    if (m) return j + __builtin_ctz(m);
   }
+  return j + __scan_scalar<Above>(x + j, n - j, t);
+}
 
-  bool PeekMinIndex(I *i) const {
-    if (length == 0 || i == nullptr) return false;
-    *i = index[0];
-    return true;
+template <bool Above>
+__attribute__((target("avx")))
+static std::ptrdiff_t __scan_avx(const double *x, std::ptrdiff_t n, double t) {
+  const __m256d vt = _mm256_set1_pd(t);
+  std::ptrdiff_t j = 0;
+  for (; j + 8 <= n; j += 8) {
+    __m256d a = _mm256_loadu_pd(x + j);
+    __m256d b = _mm256_loadu_pd(x + j + 4);
+    if (Above) {
+      a = _mm256_cmp_pd(a, vt, _CMP_GT_OQ); b = _mm256_cmp_pd(b, vt, _CMP_GT_OQ);
+    } else {
+      a = _mm256_cmp_pd(a, vt, _CMP_LT_OQ); b = _mm256_cmp_pd(b, vt, _CMP_LT_OQ);
+    }
+    int m = _mm256_movemask_pd(a) | (_mm256_movemask_pd(b) << 4);
+    if (m) return j + __builtin_ctz(m);
   }
+  return j + __scan_scalar<Above>(x + j, n - j, t);
+}
 
-  bool PeekMaxIndex(I *i) const {
-    if (length == 0 || i == nullptr) return false;
-    if (length == 1) {
-      *i = index[0];
-    } else if (length == 2) {
-      *i = index[1];
+template <bool Above>
+__attribute__((target("sse2")))
+static std::ptrdiff_t __scan_sse2(const float *x, std::ptrdiff_t n, float t) {
+  const __m128 vt = _mm_set1_ps(t);
+  std::ptrdiff_t j = 0;
+  for (; j + 8 <= n; j += 8) {
+    __m128 a = _mm_loadu_ps(x + j);
+    __m128 b = _mm_loadu_ps(x + j + 4);
+    if (Above) {
+      a = _mm_cmpgt_ps(a, vt); b = _mm_cmpgt_ps(b, vt);
     } else {
-      if (value[1] >= value[2]) {
-        *i = index[1];
-      } else {
-        *i = index[2];
-      }
+      a = _mm_cmplt_ps(a, vt); b = _mm_cmplt_ps(b, vt);
     }
-    return true;
+    int m = _mm_movemask_ps(a) | (_mm_movemask_ps(b) << 4);
+    if (m) return j + __builtin_ctz(m);
   }
+  return j + __scan_scalar<Above>(x + j, n - j, t);
+}
 
-  bool PeekMin(V *v, I *i) const {
-    return PeekMinValue(v) || PeekMinIndex(i);
+template <bool Above>
+__attribute__((target("avx")))
+static std::ptrdiff_t __scan_avx(const float *x, std::ptrdiff_t n, float t) {
+  const __m256 vt = _mm256_set1_ps(t);
+  std::ptrdiff_t j = 0;
+  for (; j + 8 <= n; j += 8) {
+    __m256 a = _mm256_loadu_ps(x + j);
+    if (Above) {
+      a = _mm256_cmp_ps(a, vt, _CMP_GT_OQ);
+    } else {
+      a = _mm256_cmp_ps(a, vt, _CMP_LT_OQ);
+    }
+    int m = _mm256_movemask_ps(a);
+    if (m) return j + __builtin_ctz(m);
   }
+  return j + __scan_scalar<Above>(x + j, n - j, t);
+}
 
-  bool PeekMax(V *v, I *i) const {
-    return PeekMaxValue(v) || PeekMaxIndex(i);
+#endif
+
+template <bool Above, class T, class V>
+static inline std::ptrdiff_t __scan(const T *x, std::ptrdiff_t n, const V &t) {
+  return __scan_scalar<Above>(x, n, t);
+}
+
+template <bool Above>
+static inline std::ptrdiff_t __scan(const double *x, std::ptrdiff_t n, double t) {
+#ifdef __MMHEAP_X86_SIMD
+  if (__builtin_cpu_supports("avx")) return __scan_avx<Above>(x, n, t);
+  if (__builtin_cpu_supports("sse2")) return __scan_sse2<Above>(x, n, t);
+#endif
+  return __scan_scalar<Above>(x, n, t);
+}
+
+template <bool Above>
+static inline std::ptrdiff_t __scan(const float *x, std::ptrdiff_t n, float t) {
+#ifdef __MMHEAP_X86_SIMD
+  if (__builtin_cpu_supports("avx")) return __scan_avx<Above>(x, n, t);
+  if (__builtin_cpu_supports("sse2")) return __scan_sse2<Above>(x, n, t);
+#endif
+  return __scan_scalar<Above>(x, n, t);
+}
+
+// advance first (and the running index j) to the first element
+// that passes the threshold test; generic iterators are tested one by one
+
+template <bool Above, class It, class V, class I>
+static inline It __first_past(It first, It last, const V &t, I &j) {
+  if (Above) {
+    while (first != last && !(*first > t)) { ++first; ++j; }
+  } else {
+    while (first != last && !(*first < t)) { ++first; ++j; }
   }
+  return first;
+}
 
-  /* Insert and remove ops are O(log(k)), k = length */
+template <bool Above, class T, class V, class I>
+static inline T *__first_past(T *first, T *last, const V &t, I &j) {
+  std::ptrdiff_t d = __scan<Above>(first, last - first, t);
+  j += I(d);
+  return first + d;
+}
 
-  bool Insert(V v, I i) {
-    if (length == maxlength) return false;
-    V *A = value;
-    I *B = index;
-    int j = length;
-    length++;
-    A[j] = v;
-    B[j] = i;
-    MinMaxHeapAux::__bubble_up<V, I>(A, B, length);
-    return true;
+// index type stand-in for keys-only heaps (I = void);
+// none() is the default index argument and only compiles for I = void
+
+struct __noindex { };
+
+template <class I>
+struct __index_type {
+  typedef I type;
+  static I none() {
+    static_assert(sizeof(I) == 0, "this heap requires an index argument");
+    return I();
   }
+};
 
-  bool RemoveMin() {
-    // replace min value (root) with last heap element then trickle down
-    if (length == 0) return false;
-    V *A = value;
-    I *B = index;
-    V last_a = A[length - 1];
-    I last_b = B[length - 1];
-    length--;  // remove last element
-    A[0] = last_a;
-    B[0] = last_b;  // reinsert at root
-    MinMaxHeapAux::__trickle_down<V, I>(A, B, 1, length);  // restore heap property
-    return true;
+template <>
+struct __index_type<void> {
+  typedef __noindex type;
+  static __noindex none() { return __noindex(); }
+};
+
+// index j of a bulk-loaded array i; i == nullptr means 0..n-1
+template <class I>
+static inline I __bulk_index(const I *i, int j) { return (i != nullptr) ? i[j] : I(j); }
+
+static inline __noindex __bulk_index(const void *, int) { return __noindex(); }
+
+// an element held outside a store (see MinMaxHeapLayout)
+
+template <class V, class I>
+struct __elem {
+  V value;
+  I index;
+};
+
+template <class V>
+struct __elem<V, void> {
+  V value;
+};
+
+// arrays of m default-initialized T from allocator policy A;
+// nullptr if A is out of memory
+
+template <class T, class A>
+static inline T *__alloc_array(A& a, int m) {
+  T *t = static_cast<T *>(a.allocate(sizeof(T) * (std::size_t) m, alignof(T)));
+  if (t != nullptr && !std::is_trivially_default_constructible<T>::value) {
+    for (int j = 0; j < m; j++) ::new ((void *) (t + j)) T;
   }
+  return t;
+}
 
-  bool RemoveMax() {
-    // replace max value (always a child of root or the root) with last heap element then trickle down
-    if (length == 0) return false;
-    V *A = value;
-    I *B = index;
-    V last_a = A[length - 1];
-    I last_b = B[length - 1];
-    int iins;
-    if (length == 1) {
-      iins = 1;
-    } else if (length == 2) {
-      iins = 2;
-    } else {
-      if (value[1] >= value[2]) {
-        iins = 2;
-      } else {
-        iins = 3;
+template <class T, class A>
+static inline void __free_array(A& a, T *t, int m) {
+  if (t == nullptr) return;
+  if (!std::is_trivially_destructible<T>::value) {
+    for (int j = 0; j < m; j++) t[j].~T();
+  }
+  a.deallocate(t, sizeof(T) * (std::size_t) m, alignof(T));
+}
+
+// value[] and index[] arrays from one allocation
+
+template <class V, class I>
+static inline std::size_t __pair_offset(int m) {
+  return (sizeof(V) * (std::size_t) m + alignof(I) - 1) / alignof(I) * alignof(I);
+}
+
+template <class V, class I, class A>
+static inline bool __alloc_pair(A& a, int m, V *&v, I *&i) {
+  const std::size_t al = alignof(V) > alignof(I) ? alignof(V) : alignof(I);
+  char *c = static_cast<char *>(a.allocate(__pair_offset<V, I>(m) + sizeof(I) * (std::size_t) m, al));
+  if (c == nullptr) return false;
+  v = reinterpret_cast<V *>(c);
+  i = reinterpret_cast<I *>(c + __pair_offset<V, I>(m));
+  if (!std::is_trivially_default_constructible<V>::value) {
+    for (int j = 0; j < m; j++) ::new ((void *) (v + j)) V;
+  }
+  if (!std::is_trivially_default_constructible<I>::value) {
+    for (int j = 0; j < m; j++) ::new ((void *) (i + j)) I;
+  }
+  return true;
+}
+
+template <class V, class I, class A>
+static inline void __free_pair(A& a, int m, V *v, I *i) {
+  if (v == nullptr) return;
+  const std::size_t al = alignof(V) > alignof(I) ? alignof(V) : alignof(I);
+  if (!std::is_trivially_destructible<V>::value) {
+    for (int j = 0; j < m; j++) v[j].~V();
+  }
+  if (!std::is_trivially_destructible<I>::value) {
+    for (int j = 0; j < m; j++) i[j].~I();
+  }
+  a.deallocate(v, __pair_offset<V, I>(m) + sizeof(I) * (std::size_t) m, al);
+}
+
+/* Heap snapshots (MinMaxHeap::Save/Load, MappedMinMaxHeap in fmmheap.h,
+   mmheap_save/mmheap_load in cmmheap.h share the format): a 64-byte
+   header, then value[0..length) and index[0..length) in heap order
+   (position p at [p-1]), each section zero-padded to a multiple of 64
+   bytes; keys-only heaps have no index section. Native byte order. The
+   checksum is taken over header bytes [0, 24) and the padded sections as
+   64-bit words. */
+
+const std::uint32_t __snapshot_magic = 0x50484d4du;  // "MMHP"
+const std::uint16_t __snapshot_version = 1;
+
+struct __snapshot_header {
+  std::uint32_t magic;
+  std::uint16_t version;
+  std::uint8_t arity;
+  std::uint8_t flags;        // 1: keys are layout codes (Packed); 2: growable
+  std::uint16_t vsize;
+  std::uint16_t isize;       // 0: keys-only
+  std::uint8_t vkind;        // 1 floating point, 2 signed, 3 unsigned integer
+  std::uint8_t ikind;
+  std::uint16_t reserved0;
+  std::int32_t length;
+  std::int32_t maxlength;
+  std::uint64_t checksum;
+  std::uint8_t reserved[32];
+};
+
+static_assert(sizeof(__snapshot_header) == 64, "snapshot header is 64 bytes");
+
+static inline std::size_t __snapshot_pad(std::size_t bytes) { return (bytes + 63) & ~(std::size_t) 63; }
+
+template <class T>
+struct __snapshot_type {
+  static_assert(std::is_trivially_copyable<T>::value, "snapshots need trivially copyable values and indices");
+  static const std::uint16_t size = sizeof(T);
+  static const std::uint8_t kind = std::is_floating_point<T>::value ? 1
+    : std::is_integral<T>::value ? (std::is_signed<T>::value ? 2 : 3) : 0;
+  static T get(const unsigned char *b, int j) {
+    T t;
+    std::memcpy(&t, b + sizeof(T) * (std::size_t) j, sizeof(T));
+    return t;
+  }
+};
+
+template <>
+struct __snapshot_type<void> {
+  static const std::uint16_t size = 0;
+  static const std::uint8_t kind = 0;
+  static __noindex get(const unsigned char *, int) { return __noindex(); }
+};
+
+// FNV-1a over 64-bit words; add() may be called with any byte counts
+struct __checksum {
+  std::uint64_t h = 0xcbf29ce484222325ull;
+  unsigned char t[8];
+  int nb = 0;
+
+  void __mix(const unsigned char *c) {
+    std::uint64_t w;
+    std::memcpy(&w, c, 8);
+    h = (h ^ w) * 0x100000001b3ull;
+  }
+  void add(const void *p, std::size_t n) {
+    const unsigned char *c = static_cast<const unsigned char *>(p);
+    for (; n > 0 && nb != 0; n--) {
+      t[nb++] = *c++;
+      if (nb == 8) {
+        __mix(t);
+        nb = 0;
       }
     }
-    length--;    // remove last element
-    A[iins - 1] = last_a;    // reinsert at position where the max was previously
-    B[iins - 1] = last_b;
-    MinMaxHeapAux::__trickle_down<V, I>(A, B, iins, length);  // restore heap property
-    return true;
+    for (; n >= 8; n -= 8, c += 8) __mix(c);
+    if (n > 0) {  // nb == 0 here
+      std::memcpy(t, c, n);
+      nb = (int) n;
+    }
+  }
+  std::uint64_t value() {
+    if (nb != 0) {
+      std::memset(t + nb, 0, 8 - nb);
+      __mix(t);
+      nb = 0;
+    }
+    return h;
+  }
+};
+
+// check everything but the checksum against the expected element types;
+// *bytes is the size of the padded sections that follow the header
+static inline bool __snapshot_check(const __snapshot_header& h, std::uint16_t vsize, std::uint8_t vkind,
+                                    std::uint16_t isize, std::uint8_t ikind, std::size_t *bytes) {
+  if (h.magic != __snapshot_magic || h.version != __snapshot_version) return false;
+  if (h.vsize != vsize || h.vkind != vkind || h.isize != isize || h.ikind != ikind) return false;
+  if (h.length < 0 || h.maxlength < h.length) return false;
+  *bytes = __snapshot_pad((std::size_t) h.length * vsize) + __snapshot_pad((std::size_t) h.length * isize);
+  return true;
+}
+
+// flush and close f, written as tmp, and rename it over path; an
+// existing snapshot at path stays intact until the new one is on disk
+static inline bool __commit_file(std::FILE *f, bool ok, const std::string& tmp, const char *path) {
+  ok = ok && std::fflush(f) == 0;
+#ifdef __MMHEAP_FSYNC
+  ok = ok && ::fsync(::fileno(f)) == 0;
+#endif
+  ok = (std::fclose(f) == 0) && ok;
+  ok = ok && std::rename(tmp.c_str(), path) == 0;
+  if (!ok) std::remove(tmp.c_str());
+  return ok;
+}
+
+} // end aux. namespace
+
+/*
+ * Allocator policies for MinMaxHeap.
+ *
+ * A policy is a small copyable object with
+ *   void *allocate(std::size_t bytes, std::size_t align)
+ *   void deallocate(void *p, std::size_t bytes, std::size_t align)
+ * where allocate may return nullptr when out of memory (the heap then
+ * reports failure instead of growing).
+ *
+ *   New       global operator new/delete (default)
+ *   ArenaRef  bump allocation from an Arena; deallocate only gives memory
+ *             back if it was the last block handed out, and Arena::Reset()
+ *             recycles everything at once. An Arena either owns a list of
+ *             chunks from operator new, or wraps a caller-provided buffer
+ *             and fails when that is used up.
+ */
+
+namespace MinMaxHeapAlloc
+{
+
+struct New
+{
+  void *allocate(std::size_t bytes, std::size_t align) {
+    return ::operator new(bytes, std::align_val_t(align));
+  }
+  void deallocate(void *p, std::size_t, std::size_t align) {
+    ::operator delete(p, std::align_val_t(align));
+  }
+};
+
+class Arena
+{
+public:
+  // owns chunks of (at least) chunk bytes, allocated on demand
+  explicit Arena(std::size_t chunk = 1 << 16) :
+    head(nullptr), top(nullptr), end(nullptr), chunk(chunk), owned(true), base(nullptr) { }
+
+  // bump allocation inside buf[0..bytes) only
+  Arena(void *buf, std::size_t bytes) :
+    head(nullptr), top(static_cast<char *>(buf)), end(static_cast<char *>(buf) + bytes),
+    chunk(0), owned(false), base(static_cast<char *>(buf)) { }
+
+  ~Arena() {
+    while (head != nullptr) {
+      header *n = head->next;
+      ::operator delete(head);
+      head = n;
+    }
+  }
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  void *allocate(std::size_t bytes, std::size_t align) {
+    char *p = __align(top, align);
+    if (top == nullptr || p + bytes > end) {
+      if (!owned) return nullptr;
+      std::size_t c = sizeof(header) + bytes + align;
+      if (c < chunk) c = chunk;
+      header *h = static_cast<header *>(::operator new(c));
+      h->next = head;
+      head = h;
+      top = reinterpret_cast<char *>(h + 1);
+      end = reinterpret_cast<char *>(h) + c;
+      p = __align(top, align);
+    }
+    top = p + bytes;
+    return p;
+  }
+
+  void deallocate(void *p, std::size_t bytes, std::size_t) {
+    if (static_cast<char *>(p) + bytes == top) top = static_cast<char *>(p);
+  }
+
+  // recycle all memory; keeps the most recent chunk, frees the others
+  void Reset() {
+    if (!owned) {
+      top = base;
+      return;
+    }
+    if (head == nullptr) return;
+    while (head->next != nullptr) {
+      header *n = head->next->next;
+      ::operator delete(head->next);
+      head->next = n;
+    }
+    top = reinterpret_cast<char *>(head + 1);
   }
 
 private:
-  V* value;
-  I* index;
-  int length;
-  int maxlength;
+  struct alignas(std::max_align_t) header {
+    header *next;
+  };
+
+  static char *__align(char *p, std::size_t align) {
+    std::uintptr_t u = reinterpret_cast<std::uintptr_t>(p);
+    return p + ((align - u % align) % align);
+  }
+
+  header *head;
+  char *top;
+  char *end;
+  std::size_t chunk;
+  bool owned;
+  char *base;
+};
+
+struct ArenaRef
+{
+  ArenaRef(Arena& a) : arena(&a) { }
+  void *allocate(std::size_t bytes, std::size_t align) { return arena->allocate(bytes, align); }
+  void deallocate(void *p, std::size_t bytes, std::size_t align) { arena->deallocate(p, bytes, align); }
+  Arena *arena;
+};
+
+} // end alloc namespace
+
+/*
+ * Instrumentation policies for MinMaxHeap and AddressableMinMaxHeap.
+ *
+ * The heap kernels report to the policy: key compares, element moves
+ * (the hole-based kernels' counterpart of swaps), bubble-up and
+ * trickle-down calls with their steps (a step moves the element one slot
+ * up or down; max is the deepest single call), inserts rejected by a full
+ * heap or by InsertOrEvict*, and evictions (ReplaceMin/ReplaceMax).
+ *
+ *   None   every hook is an empty inline function; compiled out (default)
+ *   Count  counts into a Snapshot, read with Stats() and cleared with
+ *          ResetStats(); a few additions per step
+ */
+
+namespace MinMaxHeapStats
+{
+
+struct Snapshot
+{
+  unsigned long long compares;
+  unsigned long long moves;
+  unsigned long long bubble_ups;
+  unsigned long long bubble_steps;
+  unsigned long long bubble_max;
+  unsigned long long trickle_downs;
+  unsigned long long trickle_steps;
+  unsigned long long trickle_max;
+  unsigned long long rejects;
+  unsigned long long evictions;
+};
+
+struct None
+{
+  void on_compare(int = 1) { }
+  void on_move() { }
+  void on_bubble() { }
+  void on_bubble_step() { }
+  void on_trickle() { }
+  void on_trickle_step() { }
+  void on_reject() { }
+  void on_evict() { }
+  Snapshot stats_snapshot() const { return Snapshot(); }
+  void stats_reset() { }
+};
+
+struct Count
+{
+  Count() : st(), depth(0) { }
+  void on_compare(int n = 1) { st.compares += n; }
+  void on_move() { st.moves++; }
+  void on_bubble() { st.bubble_ups++; depth = 0; }
+  void on_bubble_step() {
+    st.moves++;
+    st.bubble_steps++;
+    if (++depth > st.bubble_max) st.bubble_max = depth;
+  }
+  void on_trickle() { st.trickle_downs++; depth = 0; }
+  void on_trickle_step() {
+    st.moves++;
+    st.trickle_steps++;
+    if (++depth > st.trickle_max) st.trickle_max = depth;
+  }
+  void on_reject() { st.rejects++; }
+  void on_evict() { st.evictions++; }
+  Snapshot stats_snapshot() const { return st; }
+  void stats_reset() { st = Snapshot(); depth = 0; }
+
+  Snapshot st;
+  unsigned long long depth;
+};
+
+} // end stats namespace
+
+/*
+ * Storage layouts for MinMaxHeap.
+ *
+ * Each layout provides Store<V, I>, addressed by 1-based heap position p:
+ * key(p), value_at(p), index_at(p), set(p, v, i), move(dst, src) and
+ * swap(p, q), plus Allocate(a, m) / Release(a, m) with an allocator
+ * policy a (Allocate returns false if a is out of memory), copy_from(other,
+ * n) / move_from(other, n), and key_of(v, i), the key an element (v, i)
+ * would have. An element held outside the store has type elem_type; it is
+ * built with make(i, args...) (value constructed from args), moved in and
+ * out with put(p, e) / take(p), and has key key_of(e). The aux. kernels
+ * only use key(), key_of(e), move(), take() and put(). Store<V, void> keeps
+ * no index; its set() takes the MinMaxHeapAux::__noindex placeholder.
+ *
+ *   Split        separate value[] and index[] arrays (default)
+ *   Interleaved  one array of {value, index} records
+ *   Blocked      64-byte aligned blocks of 8 values followed by their 8
+ *                indices; positions are not shifted to 0-based, so the four
+ *                grandchildren 4p..4p+3 always share one block of keys
+ *   Packed       (float, int32 or uint32 value; int32 or uint32 index)
+ *                one uint64 key per element: order-preserving value bits
+ *                above index bits. Compare and swap are single integer ops,
+ *                equal values are ordered by index, and floats are in IEEE
+ *                total order (-NaN < -inf < ... < -0 < +0 < ... < +inf < NaN)
+ */
+
+namespace MinMaxHeapLayout
+{
+
+struct Split
+{
+  template <class V, class I>
+  struct Store
+  {
+    typedef V key_type;
+    typedef MinMaxHeapAux::__elem<V, I> elem_type;
+    V *value;
+    I *index;
+
+    template <class A>
+    bool Allocate(A& a, int m) { return MinMaxHeapAux::__alloc_pair(a, m, value, index); }
+    template <class A>
+    void Release(A& a, int m) { MinMaxHeapAux::__free_pair(a, m, value, index); }
+
+    static const V& key_of(const V& v, const I&) { return v; }
+    static const V& key_of(const elem_type& e) { return e.value; }
+    template <class... Args>
+    static elem_type make(I i, Args&&... args) {
+      return elem_type{V(std::forward<Args>(args)...), std::move(i)};
+    }
+    const V& key(int p) const { return value[p - 1]; }
+    const V& value_at(int p) const { return value[p - 1]; }
+    const I& index_at(int p) const { return index[p - 1]; }
+    void set(int p, const V& v, const I& i) {
+      value[p - 1] = v;
+      index[p - 1] = i;
+    }
+    elem_type take(int p) {
+      return elem_type{std::move(value[p - 1]), std::move(index[p - 1])};
+    }
+    void put(int p, elem_type&& e) {
+      value[p - 1] = std::move(e.value);
+      index[p - 1] = std::move(e.index);
+    }
+    void move(int dst, int src) {
+      value[dst - 1] = std::move(value[src - 1]);
+      index[dst - 1] = std::move(index[src - 1]);
+    }
+    void swap(int p, int q) {
+      std::swap(value[p - 1], value[q - 1]);
+      std::swap(index[p - 1], index[q - 1]);
+    }
+    void copy_from(const Store& c, int n) {
+      for (int j = 0; j < n; j++) {
+        value[j] = c.value[j];
+        index[j] = c.index[j];
+      }
+    }
+    void move_from(Store& c, int n) {
+      for (int j = 0; j < n; j++) {
+        value[j] = std::move(c.value[j]);
+        index[j] = std::move(c.index[j]);
+      }
+    }
+  };
+
+  template <class V>
+  struct Store<V, void>
+  {
+    typedef V key_type;
+    typedef MinMaxHeapAux::__elem<V, void> elem_type;
+    V *value;
+
+    template <class A>
+    bool Allocate(A& a, int m) { return (value = MinMaxHeapAux::__alloc_array<V>(a, m)) != nullptr; }
+    template <class A>
+    void Release(A& a, int m) { MinMaxHeapAux::__free_array(a, value, m); }
+
+    static const V& key_of(const V& v, MinMaxHeapAux::__noindex) { return v; }
+    static const V& key_of(const elem_type& e) { return e.value; }
+    template <class... Args>
+    static elem_type make(MinMaxHeapAux::__noindex, Args&&... args) {
+      return elem_type{V(std::forward<Args>(args)...)};
+    }
+    const V& key(int p) const { return value[p - 1]; }
+    const V& value_at(int p) const { return value[p - 1]; }
+    MinMaxHeapAux::__noindex index_at(int) const { return MinMaxHeapAux::__noindex(); }
+    void set(int p, const V& v, MinMaxHeapAux::__noindex) { value[p - 1] = v; }
+    elem_type take(int p) { return elem_type{std::move(value[p - 1])}; }
+    void put(int p, elem_type&& e) { value[p - 1] = std::move(e.value); }
+    void move(int dst, int src) { value[dst - 1] = std::move(value[src - 1]); }
+    void swap(int p, int q) { std::swap(value[p - 1], value[q - 1]); }
+    void copy_from(const Store& c, int n) {
+      for (int j = 0; j < n; j++) value[j] = c.value[j];
+    }
+    void move_from(Store& c, int n) {
+      for (int j = 0; j < n; j++) value[j] = std::move(c.value[j]);
+    }
+  };
+};
+
+struct Interleaved
+{
+  template <class V, class I>
+  struct Store
+  {
+    typedef V key_type;
+    typedef MinMaxHeapAux::__elem<V, I> elem_type;
+    struct record {
+      V value;
+      I index;
+    };
+    record *r;
+
+    template <class A>
+    bool Allocate(A& a, int m) { return (r = MinMaxHeapAux::__alloc_array<record>(a, m)) != nullptr; }
+    template <class A>
+    void Release(A& a, int m) { MinMaxHeapAux::__free_array(a, r, m); }
+
+    static const V& key_of(const V& v, const I&) { return v; }
+    static const V& key_of(const elem_type& e) { return e.value; }
+    template <class... Args>
+    static elem_type make(I i, Args&&... args) {
+      return elem_type{V(std::forward<Args>(args)...), std::move(i)};
+    }
+    const V& key(int p) const { return r[p - 1].value; }
+    const V& value_at(int p) const { return r[p - 1].value; }
+    const I& index_at(int p) const { return r[p - 1].index; }
+    void set(int p, const V& v, const I& i) {
+      r[p - 1].value = v;
+      r[p - 1].index = i;
+    }
+    elem_type take(int p) {
+      return elem_type{std::move(r[p - 1].value), std::move(r[p - 1].index)};
+    }
+    void put(int p, elem_type&& e) {
+      r[p - 1].value = std::move(e.value);
+      r[p - 1].index = std::move(e.index);
+    }
+    void move(int dst, int src) { r[dst - 1] = std::move(r[src - 1]); }
+    void swap(int p, int q) { std::swap(r[p - 1], r[q - 1]); }
+    void copy_from(const Store& c, int n) {
+      for (int j = 0; j < n; j++) r[j] = c.r[j];
+    }
+    void move_from(Store& c, int n) {
+      for (int j = 0; j < n; j++) r[j] = std::move(c.r[j]);
+    }
+  };
+
+  // without an index a record is just the value
+  template <class V>
+  struct Store<V, void> : Split::Store<V, void> { };
+};
+
+struct Blocked
+{
+  template <class V, class I>
+  struct Store
+  {
+    typedef V key_type;
+    typedef MinMaxHeapAux::__elem<V, I> elem_type;
+    struct alignas(64) block {
+      V value[8];
+      I index[8];
+    };
+    block *b;
+
+    // slot 0 unused
+    template <class A>
+    bool Allocate(A& a, int m) { return (b = MinMaxHeapAux::__alloc_array<block>(a, (m >> 3) + 1)) != nullptr; }
+    template <class A>
+    void Release(A& a, int m) { MinMaxHeapAux::__free_array(a, b, (m >> 3) + 1); }
+
+    static const V& key_of(const V& v, const I&) { return v; }
+    static const V& key_of(const elem_type& e) { return e.value; }
+    template <class... Args>
+    static elem_type make(I i, Args&&... args) {
+      return elem_type{V(std::forward<Args>(args)...), std::move(i)};
+    }
+    const V& key(int p) const { return b[p >> 3].value[p & 7]; }
+    const V& value_at(int p) const { return b[p >> 3].value[p & 7]; }
+    const I& index_at(int p) const { return b[p >> 3].index[p & 7]; }
+    void set(int p, const V& v, const I& i) {
+      b[p >> 3].value[p & 7] = v;
+      b[p >> 3].index[p & 7] = i;
+    }
+    elem_type take(int p) {
+      return elem_type{std::move(b[p >> 3].value[p & 7]), std::move(b[p >> 3].index[p & 7])};
+    }
+    void put(int p, elem_type&& e) {
+      b[p >> 3].value[p & 7] = std::move(e.value);
+      b[p >> 3].index[p & 7] = std::move(e.index);
+    }
+    void move(int dst, int src) {
+      b[dst >> 3].value[dst & 7] = std::move(b[src >> 3].value[src & 7]);
+      b[dst >> 3].index[dst & 7] = std::move(b[src >> 3].index[src & 7]);
+    }
+    void swap(int p, int q) {
+      std::swap(b[p >> 3].value[p & 7], b[q >> 3].value[q & 7]);
+      std::swap(b[p >> 3].index[p & 7], b[q >> 3].index[q & 7]);
+    }
+    void copy_from(const Store& c, int n) {
+      for (int j = 0; j <= (n >> 3); j++) b[j] = c.b[j];
+    }
+    void move_from(Store& c, int n) {
+      for (int j = 0; j <= (n >> 3); j++) b[j] = std::move(c.b[j]);
+    }
+  };
+
+  template <class V>
+  struct Store<V, void>
+  {
+    typedef V key_type;
+    typedef MinMaxHeapAux::__elem<V, void> elem_type;
+    struct alignas(64) block {
+      V value[8];
+    };
+    block *b;
+
+    // slot 0 unused
+    template <class A>
+    bool Allocate(A& a, int m) { return (b = MinMaxHeapAux::__alloc_array<block>(a, (m >> 3) + 1)) != nullptr; }
+    template <class A>
+    void Release(A& a, int m) { MinMaxHeapAux::__free_array(a, b, (m >> 3) + 1); }
+
+    static const V& key_of(const V& v, MinMaxHeapAux::__noindex) { return v; }
+    static const V& key_of(const elem_type& e) { return e.value; }
+    template <class... Args>
+    static elem_type make(MinMaxHeapAux::__noindex, Args&&... args) {
+      return elem_type{V(std::forward<Args>(args)...)};
+    }
+    const V& key(int p) const { return b[p >> 3].value[p & 7]; }
+    const V& value_at(int p) const { return b[p >> 3].value[p & 7]; }
+    MinMaxHeapAux::__noindex index_at(int) const { return MinMaxHeapAux::__noindex(); }
+    void set(int p, const V& v, MinMaxHeapAux::__noindex) { b[p >> 3].value[p & 7] = v; }
+    elem_type take(int p) { return elem_type{std::move(b[p >> 3].value[p & 7])}; }
+    void put(int p, elem_type&& e) { b[p >> 3].value[p & 7] = std::move(e.value); }
+    void move(int dst, int src) { b[dst >> 3].value[dst & 7] = std::move(b[src >> 3].value[src & 7]); }
+    void swap(int p, int q) { std::swap(b[p >> 3].value[p & 7], b[q >> 3].value[q & 7]); }
+    void copy_from(const Store& c, int n) {
+      for (int j = 0; j <= (n >> 3); j++) b[j] = c.b[j];
+    }
+    void move_from(Store& c, int n) {
+      for (int j = 0; j <= (n >> 3); j++) b[j] = std::move(c.b[j]);
+    }
+  };
+};
+
+// order-preserving 32-bit codes for the Packed layout
+template <class T> struct __packed_code;
+
+template <>
+struct __packed_code<std::uint32_t> {
+  static std::uint32_t encode(std::uint32_t v) { return v; }
+  static std::uint32_t decode(std::uint32_t k) { return k; }
+};
+
+template <>
+struct __packed_code<std::int32_t> {
+  static std::uint32_t encode(std::int32_t v) { return (std::uint32_t) v ^ 0x80000000u; }
+  static std::int32_t decode(std::uint32_t k) { return (std::int32_t) (k ^ 0x80000000u); }
+};
+
+template <>
+struct __packed_code<float> {
+  static std::uint32_t encode(float v) {
+    std::uint32_t u;
+    std::memcpy(&u, &v, sizeof(u));
+    return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+  }
+  static float decode(std::uint32_t k) {
+    std::uint32_t u = (k & 0x80000000u) ? (k ^ 0x80000000u) : ~k;
+    float v;
+    std::memcpy(&v, &u, sizeof(v));
+    return v;
+  }
+};
+
+struct Packed
+{
+  template <class V, class I>
+  struct Store
+  {
+    typedef std::uint64_t key_type;
+    typedef std::uint64_t elem_type;
+    typedef __packed_code<V> vcode;
+    typedef __packed_code<I> icode;
+    std::uint64_t *k;
+
+    template <class A>
+    bool Allocate(A& a, int m) { return (k = MinMaxHeapAux::__alloc_array<std::uint64_t>(a, m)) != nullptr; }
+    template <class A>
+    void Release(A& a, int m) { MinMaxHeapAux::__free_array(a, k, m); }
+
+    static std::uint64_t key_of(const V& v, const I& i) {
+      return ((std::uint64_t) vcode::encode(v) << 32) | icode::encode(i);
+    }
+    static const std::uint64_t& key_of(const std::uint64_t& e) { return e; }
+    template <class... Args>
+    static std::uint64_t make(I i, Args&&... args) { return key_of(V(std::forward<Args>(args)...), i); }
+    const std::uint64_t& key(int p) const { return k[p - 1]; }
+    V value_at(int p) const { return vcode::decode((std::uint32_t) (k[p - 1] >> 32)); }
+    I index_at(int p) const { return icode::decode((std::uint32_t) k[p - 1]); }
+    void set(int p, const V& v, const I& i) { k[p - 1] = key_of(v, i); }
+    std::uint64_t take(int p) { return k[p - 1]; }
+    void put(int p, std::uint64_t e) { k[p - 1] = e; }
+    void move(int dst, int src) { k[dst - 1] = k[src - 1]; }
+    void swap(int p, int q) {
+      std::uint64_t tmp = k[q - 1];
+      k[q - 1] = k[p - 1];
+      k[p - 1] = tmp;
+    }
+    void copy_from(const Store& c, int n) {
+      std::memcpy(k, c.k, sizeof(std::uint64_t) * n);
+    }
+    void move_from(Store& c, int n) { copy_from(c, n); }
+  };
+
+  // keys-only: the 32-bit value code alone
+  template <class V>
+  struct Store<V, void>
+  {
+    typedef std::uint32_t key_type;
+    typedef std::uint32_t elem_type;
+    typedef __packed_code<V> vcode;
+    std::uint32_t *k;
+
+    template <class A>
+    bool Allocate(A& a, int m) { return (k = MinMaxHeapAux::__alloc_array<std::uint32_t>(a, m)) != nullptr; }
+    template <class A>
+    void Release(A& a, int m) { MinMaxHeapAux::__free_array(a, k, m); }
+
+    static std::uint32_t key_of(const V& v, MinMaxHeapAux::__noindex) { return vcode::encode(v); }
+    static const std::uint32_t& key_of(const std::uint32_t& e) { return e; }
+    template <class... Args>
+    static std::uint32_t make(MinMaxHeapAux::__noindex, Args&&... args) {
+      return vcode::encode(V(std::forward<Args>(args)...));
+    }
+    const std::uint32_t& key(int p) const { return k[p - 1]; }
+    V value_at(int p) const { return vcode::decode(k[p - 1]); }
+    MinMaxHeapAux::__noindex index_at(int) const { return MinMaxHeapAux::__noindex(); }
+    void set(int p, const V& v, MinMaxHeapAux::__noindex) { k[p - 1] = vcode::encode(v); }
+    std::uint32_t take(int p) { return k[p - 1]; }
+    void put(int p, std::uint32_t e) { k[p - 1] = e; }
+    void move(int dst, int src) { k[dst - 1] = k[src - 1]; }
+    void swap(int p, int q) {
+      std::uint32_t tmp = k[q - 1];
+      k[q - 1] = k[p - 1];
+      k[p - 1] = tmp;
+    }
+    void copy_from(const Store& c, int n) {
+      std::memcpy(k, c.k, sizeof(std::uint32_t) * n);
+    }
+    void move_from(Store& c, int n) { copy_from(c, n); }
+  };
+};
+
+} // end layout namespace
+
+/*
+ * MinMaxHeap<V, I, L, D>: V value (heap key), I index (void: keys-only),
+ * L storage layout (MinMaxHeapLayout), D arity: 2 (binary, default), or
+ * 4 or 8 for a shallower d-ary min-max heap that reads contiguous groups
+ * of D children and D*D grandchildren per level; better suited to very
+ * large heaps where every level of a binary trickle down is a cache miss.
+ * A allocator policy (MinMaxHeapAlloc), C instrumentation policy
+ * (MinMaxHeapStats).
+ */
+
+template <class V, class I = void, class L = MinMaxHeapLayout::Split, int D = 2,
+          class A = MinMaxHeapAlloc::New, class C = MinMaxHeapStats::None>
+class MinMaxHeap
+{
+  static_assert(D == 2 || D == 4 || D == 8, "arity D must be 2, 4 or 8");
+  typedef MinMaxHeapAux::__index_type<I> __index;
+
+public:
+  typedef typename __index::type index_type;  // I, or a placeholder if keys-only
+
+  MinMaxHeap(int m) : alloc(), growable(false) {
+    __allocate(m);
+  }
+
+  /* growable heaps double their capacity when Insert finds them full */
+
+  MinMaxHeap(int m, bool growable, const A& a = A()) : alloc(a), growable(growable) {
+    __allocate(m);
+  }
+
+  MinMaxHeap(const MinMaxHeap& c) : alloc(c.alloc), growable(c.growable) {
+    __allocate(c.MaxLength());
+    int l = (c.Length() < maxlength) ? c.Length() : maxlength;
+    s.copy_from(c.s, l);
+    length = l;
+  }
+
+  /* Bulk build: copy v[0..n) and i[0..n) in and heapify bottom up in
+     O(n); capacity is max(n, m). i may be nullptr for indices 0..n-1,
+     and is ignored by keys-only heaps. */
+
+  MinMaxHeap(const V *v, const I *i, int n, int m = 0) : alloc(), growable(false) {
+    __allocate(n > m ? n : m);
+    Assign(v, i, n);
+  }
+
+  /* a moved-from heap is empty with capacity 0 */
+
+  MinMaxHeap(MinMaxHeap&& c) noexcept : alloc(c.alloc), growable(c.growable) {
+    __steal(c);
+  }
+
+  MinMaxHeap& operator=(const MinMaxHeap& c) {
+    if (this != &c) {
+      MinMaxHeap t(c);
+      s.Release(alloc, maxlength);
+      alloc = t.alloc;
+      growable = t.growable;
+      __steal(t);
+    }
+    return *this;
+  }
+
+  MinMaxHeap& operator=(MinMaxHeap&& c) noexcept {
+    if (this != &c) {
+      s.Release(alloc, maxlength);
+      alloc = c.alloc;
+      growable = c.growable;
+      __steal(c);
+    }
+    return *this;
+  }
+
+  ~MinMaxHeap() {
+    s.Release(alloc, maxlength);
+  }
+
+  int Length() const { return length; }
+  int MaxLength() const { return maxlength; }
+  bool Growable() const { return growable; }
+
+  /* Counters of the instrumentation policy C; all zero for the default */
+
+  MinMaxHeapStats::Snapshot Stats() const { return s.stats_snapshot(); }
+  void ResetStats() { s.stats_reset(); }
+
+  void Clear() { length = 0; }
+
+  /* Capacity changes reallocate and copy the heap; both return false
+     (and leave the heap as it was) if the allocator is out of memory */
+
+  bool Reserve(int m) {
+    return m <= maxlength || __reallocate(m);
+  }
+
+  bool ShrinkToFit() {
+    int m = (length > 0) ? length : 1;
+    return m == maxlength || __reallocate(m);
+  }
+
+  /* Assign replaces the contents with v[0..n), i[0..n) (see the bulk
+     constructor) in O(n); false (heap unchanged) if n is above the
+     capacity of a fixed-size heap or the allocator is out of memory */
+
+  bool Assign(const V *v, const I *i, int n) {
+    if (n < 0) n = 0;
+    if (n > maxlength) {
+      if (!growable) return false;
+      int l = length;
+      length = 0;  // the old contents are not copied over
+      if (!__reallocate(n)) {
+        length = l;
+        return false;
+      }
+    }
+    for (int p = 1; p <= n; p++) {
+      s.put(p, store::make(MinMaxHeapAux::__bulk_index(i, p - 1), v[p - 1]));
+    }
+    length = n;
+    __heapify();
+    return true;
+  }
+
+  /* MergeFrom adds all elements of o; false (heap unchanged) if they do
+     not fit in a fixed-size heap. A small o is inserted element by
+     element, otherwise o is appended and the whole heap is rebuilt in
+     O(n + m). */
+
+  bool MergeFrom(const MinMaxHeap& o) {
+    if (&o == this) {
+      MinMaxHeap t(o);
+      return MergeFrom(t);
+    }
+    int n = length + o.length;
+    if (n > maxlength && !(growable && __reallocate(n))) return false;
+    if (4 * o.length < length) {
+      for (int p = 1; p <= o.length; p++) {
+        Insert(o.s.value_at(p), o.s.index_at(p));
+      }
+    } else {
+      for (int p = 1; p <= o.length; p++) {
+        s.put(length + p, store::make(o.s.index_at(p), o.s.value_at(p)));
+      }
+      length = n;
+      __heapify();
+    }
+    return true;
+  }
+
+  /* MergeBounded keeps the k smallest (or k largest) elements of this
+     heap and o. Both heaps are walked depth-first and whole subtrees are
+     skipped once k elements are kept: a min-level element is a lower bound
+     for its subtree (k smallest), a max-level element an upper bound (k
+     largest). False (heap unchanged) if k is above the capacity of a
+     fixed-size heap. */
+
+  bool MergeBounded(const MinMaxHeap& o, int k, bool largest = false) {
+    if (&o == this) {
+      MinMaxHeap t(o);
+      return MergeBounded(t, k, largest);
+    }
+    if (k < 0) k = 0;
+    if (k > maxlength && !(growable && __reallocate(k))) return false;
+    if (length > k) {
+      MinMaxHeap t(k, false, alloc);
+      t.__admit_bounded(*this, k, largest);
+      Clear();
+      MergeFrom(t);
+    }
+    __admit_bounded(o, k, largest);
+    return true;
+  }
+
+  /* O(1) peek operations */
+
+  bool PeekMinValue(V *v) const { return MinMaxHeapAux::__peek_value<D>(s, length, false, v); }
+  bool PeekMaxValue(V *v) const { return MinMaxHeapAux::__peek_value<D>(s, length, true, v); }
+
+  bool PeekMinIndex(I *i) const {
+    static_assert(!std::is_void<I>::value, "keys-only heap has no index");
+    return MinMaxHeapAux::__peek_index<D>(s, length, false, i);
+  }
+
+  bool PeekMaxIndex(I *i) const {
+    static_assert(!std::is_void<I>::value, "keys-only heap has no index");
+    return MinMaxHeapAux::__peek_index<D>(s, length, true, i);
+  }
+
+  bool PeekMin(V *v, I *i) const {
+    return PeekMinValue(v) || PeekMinIndex(i);
+  }
+
+  bool PeekMax(V *v, I *i) const {
+    return PeekMaxValue(v) || PeekMaxIndex(i);
+  }
+
+  /* Insert and remove ops are O(log(k)), k = length;
+     the index argument is omitted for keys-only heaps.
+     Values are moved (not copied) into the heap and along sift paths */
+
+  bool Insert(V v, index_type i = __index::none()) {
+    return __emplace(std::move(i), std::move(v));
+  }
+
+  /* Emplace(i, args...) constructs the value from args;
+     keys-only heaps take Emplace(args...) */
+
+  template <class... Args>
+  bool Emplace(index_type i, Args&&... args) {
+    return __emplace(std::move(i), std::forward<Args>(args)...);
+  }
+
+  template <class J = I, class... Args>
+  typename std::enable_if<std::is_void<J>::value, bool>::type Emplace(Args&&... args) {
+    return __emplace(__index::none(), std::forward<Args>(args)...);
+  }
+
+  bool RemoveMin() {
+    // replace min value (root) with last heap element then trickle down
+    if (length == 0) return false;
+    elem_type e = s.take(length);  // reinsert last element at root
+    length--;
+    if (length > 0)
+      MinMaxHeapAux::__trickle_down<D>(s, 1, length, e);  // restore heap property
+    return true;
+  }
+
+  bool RemoveMax() {
+    // replace max value (always a child of root or the root) with last heap element then trickle down
+    if (length == 0) return false;
+    int iins = __maxpos();
+    elem_type e = s.take(length);  // reinsert at position where the max was previously
+    length--;
+    if (iins <= length)
+      MinMaxHeapAux::__trickle_down<D>(s, iins, length, e);  // restore heap property
+    return true;
+  }
+
+  /* Sorted extraction straight into v and i (either may be nullptr).
+     PopMinN/PopMaxN remove up to n elements in ascending/descending order
+     and return the number written; the drains empty the heap. When n is
+     a large part of the heap the elements are sorted once (and the rest
+     rebuilt in O(length)) instead of popped one at a time. */
+
+  int PopMinN(int n, V *v, index_type *i = nullptr) {
+    return __popn(n, v, i, false);
+  }
+
+  int PopMaxN(int n, V *v, index_type *i = nullptr) {
+    return __popn(n, v, i, true);
+  }
+
+  int DrainAscending(V *v, index_type *i = nullptr) { return __popn(length, v, i, false); }
+  int DrainDescending(V *v, index_type *i = nullptr) { return __popn(length, v, i, true); }
+
+  /* Replace ops (push-pop) are O(log(k)) with a single trickle down;
+     same result as RemoveMin()/RemoveMax() followed by Insert(v, i) */
+
+  bool ReplaceMin(V v, index_type i = __index::none()) {
+    // overwrite the root then trickle down
+    if (length == 0) return false;
+    s.on_evict();
+    elem_type e = store::make(std::move(i), std::move(v));
+    MinMaxHeapAux::__trickle_down<D>(s, 1, length, e);
+    return true;
+  }
+
+  bool ReplaceMax(V v, index_type i = __index::none()) {
+    // overwrite the max position then trickle down; if v is below the root
+    // v becomes the root, and the old min trickles down from the max position
+    if (length == 0) return false;
+    int iins = __maxpos();
+    s.on_evict();
+    elem_type e = store::make(std::move(i), std::move(v));
+    if (iins != 1) s.on_compare();
+    if (iins != 1 && s.key_of(e) < s.key(1)) {
+      elem_type t = s.take(1);
+      s.put(1, std::move(e));
+      MinMaxHeapAux::__trickle_down<D>(s, iins, length, t);
+    } else {
+      MinMaxHeapAux::__trickle_down<D>(s, iins, length, e);
+    }
+    return true;
+  }
+
+  /* Bounded insert: while the heap is not full this is Insert(v, i).
+     When full, InsertOrEvictMax keeps the smallest elements; (v, i) replaces
+     the max element if v is below it. InsertOrEvictMin keeps the largest.
+     Returns true if an element left the heap (the old extreme, or (v, i)
+     itself if it was not admitted) and writes it to *ev, *ei if not nullptr.
+     A heap of capacity 0 (moved from, or out of memory) grows if it can and
+     rejects (v, i) otherwise. */
+
+  bool InsertOrEvictMax(V v, index_type i, V *ev, index_type *ei) {
+    if (length != maxlength) return !Insert(v, i);
+    if (length == 0) return __insert_or_reject(v, i, ev, ei);
+    int imax = __maxpos();
+    s.on_compare();
+    if (s.key_of(v, i) < s.key(imax)) {
+      if (ev != nullptr) *ev = s.value_at(imax);
+      if (ei != nullptr) *ei = s.index_at(imax);
+      ReplaceMax(std::move(v), std::move(i));
+    } else {
+      s.on_reject();
+      if (ev != nullptr) *ev = std::move(v);
+      if (ei != nullptr) *ei = std::move(i);
+    }
+    return true;
+  }
+
+  bool InsertOrEvictMin(V v, index_type i, V *ev, index_type *ei) {
+    if (length != maxlength) return !Insert(v, i);
+    if (length == 0) return __insert_or_reject(v, i, ev, ei);
+    s.on_compare();
+    if (s.key_of(v, i) > s.key(1)) {
+      if (ev != nullptr) *ev = s.value_at(1);
+      if (ei != nullptr) *ei = s.index_at(1);
+      ReplaceMin(std::move(v), std::move(i));
+    } else {
+      s.on_reject();
+      if (ev != nullptr) *ev = std::move(v);
+      if (ei != nullptr) *ei = std::move(i);
+    }
+    return true;
+  }
+
+  // keys-only forms
+  bool InsertOrEvictMax(V v, V *ev) { return InsertOrEvictMax(v, __index::none(), ev, nullptr); }
+  bool InsertOrEvictMin(V v, V *ev) { return InsertOrEvictMin(v, __index::none(), ev, nullptr); }
+
+  /* Snapshots (format at MinMaxHeapAux::__snapshot_header): Save writes
+     the capacity, the growable flag and the elements in heap order to
+     path, Load replaces the heap with a saved one and takes its capacity
+     (at least 1) and growable mode (shared with mmheap_save), rebuilding it in
+     O(n) if it was saved with another arity or layout order. V and I must
+     be trivially copyable. Save writes path.tmp, syncs it and renames it
+     over path, so a failed save leaves any previous snapshot in place.
+     Both return false on I/O errors, Load (heap unchanged) also on a
+     checksum or element type mismatch. */
+
+  bool Save(const char *path) const {
+    typedef MinMaxHeapAux::__snapshot_type<V> vt;
+    typedef MinMaxHeapAux::__snapshot_type<I> it;
+    MinMaxHeapAux::__snapshot_header h = MinMaxHeapAux::__snapshot_header();
+    h.magic = MinMaxHeapAux::__snapshot_magic;
+    h.version = MinMaxHeapAux::__snapshot_version;
+    h.arity = D;
+    h.flags = __snapshot_flags();
+    h.vsize = vt::size;
+    h.isize = it::size;
+    h.vkind = vt::kind;
+    h.ikind = it::kind;
+    h.length = length;
+    h.maxlength = maxlength;
+    std::string tmp = std::string(path) + ".tmp";
+    std::FILE *f = std::fopen(tmp.c_str(), "wb");
+    if (f == nullptr) return false;
+    MinMaxHeapAux::__checksum c;
+    c.add(&h, 24);
+    // the header is written again once the checksum is known
+    bool ok = std::fwrite(&h, sizeof(h), 1, f) == 1
+      && __save_section<V>(f, c, [this](int p) -> V { return s.value_at(p); })
+      && __save_indices(f, c, std::is_void<I>());
+    h.checksum = c.value();
+    ok = ok && std::fseek(f, 0, SEEK_SET) == 0 && std::fwrite(&h, sizeof(h), 1, f) == 1;
+    return MinMaxHeapAux::__commit_file(f, ok, tmp, path);
+  }
+
+  bool Load(const char *path) {
+    typedef MinMaxHeapAux::__snapshot_type<V> vt;
+    typedef MinMaxHeapAux::__snapshot_type<I> it;
+    std::FILE *f = std::fopen(path, "rb");
+    if (f == nullptr) return false;
+    MinMaxHeapAux::__snapshot_header h;
+    std::size_t bytes = 0;
+    unsigned char *b = nullptr;
+    long size = 0;
+    // the sections must fill the rest of the file, so length is bounded by the file size
+    bool ok = std::fread(&h, sizeof(h), 1, f) == 1
+      && MinMaxHeapAux::__snapshot_check(h, vt::size, vt::kind, it::size, it::kind, &bytes)
+      && std::fseek(f, 0, SEEK_END) == 0 && (size = std::ftell(f)) >= 0
+      && (std::size_t) size == sizeof(h) + bytes
+      && std::fseek(f, (long) sizeof(h), SEEK_SET) == 0
+      && (b = new (std::nothrow) unsigned char [bytes + 1]) != nullptr
+      && std::fread(b, 1, bytes, f) == bytes;
+    std::fclose(f);
+    if (ok) {
+      MinMaxHeapAux::__checksum c;
+      c.add(&h, 24);
+      c.add(b, bytes);
+      ok = (c.value() == h.checksum);
+    }
+    if (ok) {
+      MinMaxHeap t(h.maxlength, (h.flags & 2) != 0, alloc);
+      ok = (t.maxlength != 0);  // capacity max(maxlength, 1), or 0 if out of memory
+      if (ok) {
+        const unsigned char *bi = b + MinMaxHeapAux::__snapshot_pad((std::size_t) h.length * vt::size);
+        for (int p = 1; p <= h.length; p++) {
+          t.s.put(p, store::make(it::get(bi, p - 1), vt::get(b, p - 1)));
+        }
+        t.length = h.length;
+        if (h.arity != D || (h.flags & 1) != (__snapshot_flags() & 1)) t.__heapify();
+        *this = std::move(t);
+      }
+    }
+    delete [] b;
+    return ok;
+  }
+
+private:
+  typedef MinMaxHeapAux::__shifted<typename L::template Store<V, I>, D - 2, C> store;
+  typedef typename store::elem_type elem_type;
+
+  void __allocate(int m) {
+    if (m <= 0) m = 1; // Construct something valid always
+    if (!s.Allocate(alloc, m)) {
+      s = store();
+      m = 0;
+    }
+    maxlength = m;
+    length = 0;
+  }
+
+  // bit 0: the store orders by a code of (value, index), not by value
+  int __snapshot_flags() const {
+    return (std::is_same<typename store::key_type, V>::value ? 0 : 1) | (growable ? 2 : 0);
+  }
+
+  // write one snapshot section, get(p) for p = 1..length, zero-padded
+  template <class T, class Get>
+  bool __save_section(std::FILE *f, MinMaxHeapAux::__checksum& c, Get get) const {
+    const int m = (sizeof(T) < 4096) ? 4096 / sizeof(T) : 1;
+    static const unsigned char zero[64] = { };
+    unsigned char b[m * sizeof(T)];
+    for (int p = 1; p <= length; ) {
+      int l = 0;
+      for (; l < m && p <= length; l++, p++) {
+        T t = get(p);
+        std::memcpy(b + sizeof(T) * l, &t, sizeof(T));
+      }
+      c.add(b, sizeof(T) * l);
+      if (std::fwrite(b, sizeof(T), l, f) != (std::size_t) l) return false;
+    }
+    std::size_t bytes = sizeof(T) * (std::size_t) length;
+    std::size_t pad = MinMaxHeapAux::__snapshot_pad(bytes) - bytes;
+    c.add(zero, pad);
+    return std::fwrite(zero, 1, pad, f) == pad;
+  }
+
+  bool __save_indices(std::FILE *f, MinMaxHeapAux::__checksum& c, std::false_type) const {
+    return __save_section<I>(f, c, [this](int p) -> I { return s.index_at(p); });
+  }
+
+  bool __save_indices(std::FILE *, MinMaxHeapAux::__checksum&, std::true_type) const { return true; }
+
+  // admit the elements of o that make the k best (k <= maxlength)
+  void __admit_bounded(const MinMaxHeap& o, int k, bool largest) {
+    if (k == 0 || o.length == 0) return;
+    int st[32 * D];  // DFS stack; at most (D-1) * depth + 1 entries
+    int top = 0;
+    st[top++] = 1;
+    while (top > 0) {
+      int p = st[--top];
+      bool minlevel = (D == 2) ? MinMaxHeapAux::__isminlevel(p) : MinMaxHeapAux::__isminlevel_dary<D>(p);
+      if (length < k) {
+        Insert(o.s.value_at(p), o.s.index_at(p));
+      } else if (!largest) {
+        if (o.s.key(p) < s.key(__maxpos())) {
+          ReplaceMax(o.s.value_at(p), o.s.index_at(p));
+        } else if (minlevel) {
+          continue;  // nothing below p is smaller
+        }
+      } else {
+        if (s.key(1) < o.s.key(p)) {
+          ReplaceMin(o.s.value_at(p), o.s.index_at(p));
+        } else if (!minlevel) {
+          continue;  // nothing below p is larger
+        }
+      }
+      int c = (D == 2) ? (p << 1) : MinMaxHeapAux::__dary_child<D>(p);
+      int ce = (c + D - 1 < o.length) ? c + D - 1 : o.length;
+      for (int q = ce; q >= c; q--) st[top++] = q;
+    }
+  }
+
+  int __popn(int n, V *v, index_type *i, bool largest) {
+    if (n > length) n = length;
+    if (n < 0) n = 0;
+    if (4 * n >= length && length > 16 && __sort(largest)) {
+      for (int j = 0; j < n; j++) {
+        if (v != nullptr) v[j] = s.value_at(j + 1);
+        if (i != nullptr) i[j] = s.index_at(j + 1);
+      }
+      for (int p = n + 1; p <= length; p++) s.move(p - n, p);
+      length -= n;
+      __heapify();
+      return n;
+    }
+    for (int j = 0; j < n; j++) {
+      int p = largest ? __maxpos() : 1;
+      if (v != nullptr) v[j] = s.value_at(p);
+      if (i != nullptr) i[j] = s.index_at(p);
+      elem_type e = s.take(length);
+      length--;
+      if (p <= length)
+        MinMaxHeapAux::__trickle_down<D>(s, p, length, e);
+    }
+    return n;
+  }
+
+  // sort positions 1..length ascending (or descending) through a scratch
+  // array; false if it cannot be allocated
+  bool __sort(bool descending) {
+    elem_type *t = MinMaxHeapAux::__alloc_array<elem_type>(alloc, length);
+    if (t == nullptr) return false;
+    for (int p = 1; p <= length; p++) t[p - 1] = s.take(p);
+    if (descending) {
+      std::sort(t, t + length, [](const elem_type& a, const elem_type& b) { return store::key_of(b) < store::key_of(a); });
+    } else {
+      std::sort(t, t + length, [](const elem_type& a, const elem_type& b) { return store::key_of(a) < store::key_of(b); });
+    }
+    for (int p = 1; p <= length; p++) s.put(p, std::move(t[p - 1]));
+    MinMaxHeapAux::__free_array(alloc, t, length);
+    return true;
+  }
+
+  // bottom-up heap construction over positions 1..length
+  void __heapify() {
+    int last = (D == 2) ? (length >> 1) : (length > 1 ? MinMaxHeapAux::__dary_parent<D>(length) : 0);
+    for (int p = last; p >= 1; p--) {
+      elem_type e = s.take(p);
+      MinMaxHeapAux::__trickle_down<D>(s, p, length, e);
+    }
+  }
+
+  // take over c's storage and leave c empty with capacity 0
+  void __steal(MinMaxHeap& c) {
+    s = c.s;
+    length = c.length;
+    maxlength = c.maxlength;
+    c.s = store();
+    c.length = 0;
+    c.maxlength = 0;
+  }
+
+  template <class... Args>
+  bool __emplace(index_type i, Args&&... args) {
+    if (length == maxlength && !(growable && __reallocate(2 * maxlength))) {
+      s.on_reject();
+      return false;
+    }
+    elem_type e = store::make(std::move(i), std::forward<Args>(args)...);
+    length++;
+    MinMaxHeapAux::__bubble_up<D>(s, length, e);
+    return true;
+  }
+
+  // bounded insert into a heap of capacity 0: Insert grows it when growable
+  bool __insert_or_reject(V& v, index_type& i, V *ev, index_type *ei) {
+    if (Insert(v, i)) return false;
+    if (ev != nullptr) *ev = std::move(v);
+    if (ei != nullptr) *ei = std::move(i);
+    return true;
+  }
+
+  bool __reallocate(int m) {
+    if (m <= 0) m = 1;
+    store t;
+    if (!t.Allocate(alloc, m)) return false;
+    t.move_from(s, length);
+    s.Release(alloc, maxlength);
+    s = t;
+    maxlength = m;
+    return true;
+  }
+
+  // 1-based position of the max element (the root or one of its children); length > 0
+  int __maxpos() const { return MinMaxHeapAux::__maxpos<D>(s, length); }
+
+  store s;
+  int length;
+  int maxlength;
+  A alloc;
+  bool growable;
+};
+
+/*
+ * AddressableMinMaxHeap<V, I, L, D>: a MinMaxHeap whose indices are
+ * distinct integers in [0, n), with a map from index to heap position
+ * that the store keeps up to date as elements move. An element can then
+ * be looked up, re-prioritized or removed by its index in O(log(k))
+ * instead of a rebuild or a linear search. C instrumentation policy
+ * (MinMaxHeapStats).
+ */
+
+template <class V, class I = int, class L = MinMaxHeapLayout::Split, int D = 2,
+          class C = MinMaxHeapStats::None>
+class AddressableMinMaxHeap
+{
+  static_assert(std::is_integral<I>::value, "addressable heaps need integer indices");
+  static_assert(D == 2 || D == 4 || D == 8, "arity D must be 2, 4 or 8");
+
+public:
+  /* capacity m, indices in [0, n); n = m if omitted */
+
+  AddressableMinMaxHeap(int m, int n = 0) {
+    if (m <= 0) m = 1; // Construct something valid always
+    if (n <= 0) n = m;
+    s.Allocate(alloc, m);
+    s.pos = new int [n]();
+    maxlength = m;
+    maxindex = n;
+    length = 0;
+  }
+
+  AddressableMinMaxHeap(const AddressableMinMaxHeap& c) {
+    s.Allocate(alloc, c.maxlength);
+    s.pos = new int [c.maxindex];
+    std::memcpy(s.pos, c.s.pos, sizeof(int) * c.maxindex);
+    s.copy_from(c.s, c.length);
+    maxlength = c.maxlength;
+    maxindex = c.maxindex;
+    length = c.length;
+  }
+
+  AddressableMinMaxHeap& operator=(const AddressableMinMaxHeap&) = delete;
+
+  ~AddressableMinMaxHeap() {
+    s.Release(alloc, maxlength);
+    delete[] s.pos;
+  }
+
+  int Length() const { return length; }
+  int MaxLength() const { return maxlength; }
+  int MaxIndex() const { return maxindex; }
+
+  MinMaxHeapStats::Snapshot Stats() const { return s.stats_snapshot(); }
+  void ResetStats() { s.stats_reset(); }
+
+  void Clear() {
+    for (int p = 1; p <= length; p++) s.pos[s.index_at(p)] = 0;
+    length = 0;
+  }
+
+  /* O(1) lookups */
+
+  bool Contains(I i) const {
+    return i >= 0 && i < (I) maxindex && s.pos[i] != 0;
+  }
+
+  bool PeekValue(I i, V *v) const {
+    if (!Contains(i) || v == nullptr) return false;
+    *v = s.value_at(s.pos[i]);
+    return true;
+  }
+
+  bool PeekMinValue(V *v) const { return MinMaxHeapAux::__peek_value<D>(s, length, false, v); }
+  bool PeekMaxValue(V *v) const { return MinMaxHeapAux::__peek_value<D>(s, length, true, v); }
+  bool PeekMinIndex(I *i) const { return MinMaxHeapAux::__peek_index<D>(s, length, false, i); }
+  bool PeekMaxIndex(I *i) const { return MinMaxHeapAux::__peek_index<D>(s, length, true, i); }
+
+  /* element at heap position p in [1, Length()]; for iterating in heap order */
+
+  bool PeekAt(int p, V *v, I *i) const {
+    if (p < 1 || p > length) return false;
+    if (v != nullptr) *v = s.value_at(p);
+    if (i != nullptr) *i = s.index_at(p);
+    return true;
+  }
+
+  /* O(log(k)) ops; Insert fails if the heap is full or i is out of
+     range or already present, Update and Erase if i is not present */
+
+  bool Insert(V v, I i) {
+    if (length == maxlength) {
+      s.on_reject();
+      return false;
+    }
+    if (i < 0 || i >= (I) maxindex || s.pos[i] != 0) return false;
+    elem_type e = store::make(i, std::move(v));
+    length++;
+    MinMaxHeapAux::__bubble_up<D>(s, length, e);
+    return true;
+  }
+
+  bool Update(I i, V v) {
+    if (!Contains(i)) return false;
+    elem_type e = store::make(i, std::move(v));
+    MinMaxHeapAux::__sift<D>(s, s.pos[i], length, e);
+    return true;
+  }
+
+  bool Erase(I i) {
+    if (!Contains(i)) return false;
+    int p = s.pos[i];
+    s.pos[i] = 0;
+    elem_type e = s.take(length);  // last element fills the hole at p
+    length--;
+    if (p <= length)
+      MinMaxHeapAux::__sift<D>(s, p, length, e);
+    return true;
+  }
+
+  bool RemoveMin() {
+    return length != 0 && Erase(s.index_at(1));
+  }
+
+  bool RemoveMax() {
+    return length != 0 && Erase(s.index_at(__maxpos()));
+  }
+
+private:
+  typedef MinMaxHeapAux::__tracked<MinMaxHeapAux::__shifted<typename L::template Store<V, I>, D - 2, C> > store;
+  typedef typename store::elem_type elem_type;
+
+  // 1-based position of the max element (the root or one of its children); length > 0
+  int __maxpos() const { return MinMaxHeapAux::__maxpos<D>(s, length); }
+
+  store s;
+  MinMaxHeapAlloc::New alloc;
+  int length;
+  int maxlength;
+  int maxindex;
+};
+
+/*
+ * TopK maintains the k smallest (or k largest) elements of a stream
+ * in a MinMaxHeap of capacity k. Each pushed value is paired with an
+ * index; by default its position in the stream.
+ *
+ * Once the heap is full, the scan keeps the current threshold (the heap
+ * max for k-smallest, the heap min for k-largest) in a local variable,
+ * so that most elements are rejected with a single compare. Scans over
+ * double or float arrays compare 8 elements at a time (SSE2/AVX) and only
+ * drop to the heap for elements that pass.
+ */
+
+template <class V, class I, class L = MinMaxHeapLayout::Split, int D = 2>
+class TopK
+{
+public:
+  /* k <= 0 is an empty selection: elements are counted, none is kept */
+
+  TopK(int k, bool largest = false) : heap(k), k(k < 0 ? 0 : k), largest(largest), count(0) { }
+
+  int K() const { return k; }
+  int Length() const { return heap.Length(); }
+  bool Largest() const { return largest; }
+  I Count() const { return count; }  // number of elements pushed so far
+
+  /* Current admission threshold; only defined once the heap is full */
+
+  bool Threshold(V *v) const {
+    if (k == 0 || heap.Length() != heap.MaxLength()) return false;
+    return largest ? heap.PeekMinValue(v) : heap.PeekMaxValue(v);
+  }
+
+  /* Push a single element with an explicit index */
+
+  void Push(V v, I i) {
+    if (k == 0) {
+      // nothing is kept
+    } else if (heap.Length() != heap.MaxLength()) {
+      heap.Insert(v, i);
+    } else {
+      V t = V();
+      if (largest) {
+        heap.PeekMinValue(&t);
+        if (v > t) heap.ReplaceMin(v, i);
+      } else {
+        heap.PeekMaxValue(&t);
+        if (v < t) heap.ReplaceMax(v, i);
+      }
+    }
+    count++;
+  }
+
+  /* Scan a range; the element at first[j] gets index Count() + j */
+
+  template <class It>
+  void Scan(It first, It last) {
+    I j = count;
+    if (k == 0) {
+      count = j + (I) std::distance(first, last);
+      return;
+    }
+    while (first != last && heap.Length() != heap.MaxLength()) {
+      heap.Insert(*first, j);
+      ++first;
+      ++j;
+    }
+    if (first != last) {
+      if (largest) {
+        j = __scan_largest(first, last, j);
+      } else {
+        j = __scan_smallest(first, last, j);
+      }
+    }
+    count = j;
+  }
+
+  template <class T>
+  void Scan(const T *x, int n) {
+    Scan(x, x + n);
+  }
+
+  /* Empty the heap into xk and ik (either may be nullptr) and return the
+     number of elements written: ascending order for k-smallest,
+     descending order for k-largest. Count() is not reset. */
+
+  int Emit(V *xk, I *ik) {
+    return largest ? heap.DrainDescending(xk, ik) : heap.DrainAscending(xk, ik);
+  }
+
+  void Clear() {
+    heap.Clear();
+    count = 0;
+  }
+
+  const MinMaxHeap<V, I, L, D>& Heap() const { return heap; }
+
+private:
+  template <class It>
+  I __scan_smallest(It first, It last, I j) {
+    V t = V();
+    heap.PeekMaxValue(&t);
+    for (;;) {
+      first = MinMaxHeapAux::__first_past<false>(first, last, t, j);
+      if (first == last) break;
+      heap.ReplaceMax(*first, j);
+      heap.PeekMaxValue(&t);
+      ++first;
+      ++j;
+    }
+    return j;
+  }
+
+  template <class It>
+  I __scan_largest(It first, It last, I j) {
+    V t = V();
+    heap.PeekMinValue(&t);
+    for (;;) {
+      first = MinMaxHeapAux::__first_past<true>(first, last, t, j);
+      if (first == last) break;
+      heap.ReplaceMin(*first, j);
+      heap.PeekMinValue(&t);
+      ++first;
+      ++j;
+    }
+    return j;
+  }
+
+  MinMaxHeap<V, I, L, D> heap;
+  int k;
+  bool largest;
+  I count;
+};
+
+/*
+ * WindowTopK keeps the k smallest (or k largest) of the last w samples
+ * of a stream; each sample is paired with its stream position (0, 1, ...)
+ * as index. Samples live in two AddressableMinMaxHeaps addressed by
+ * position mod w: top holds the k best of the window and rest the others,
+ * so an expired sample is erased by its slot wherever it is, and the best
+ * of rest is promoted when a top sample expires. Top ops are O(log(k));
+ * a sample that expires from rest is overwritten in place by the new one
+ * (one sift, O(1) on average), other rest ops are O(log(w)).
+ * The stream position is counted in long long; reported indices are
+ * narrowed to I, so use I = long long for streams past 2^31 samples.
+ */
+
+template <class V, class I = int, class L = MinMaxHeapLayout::Split, int D = 2>
+class WindowTopK
+{
+public:
+  /* k <= 0 is an empty selection: samples are counted, none is kept */
+
+  WindowTopK(int k, int w, bool largest = false) :
+    top(k < 1 ? 1 : k, w < 1 ? 1 : w), rest(w < 1 ? 1 : w, w < 1 ? 1 : w),
+    k(k < 0 ? 0 : k), w(w < 1 ? 1 : w), largest(largest), count(0) { }
+
+  int K() const { return k; }
+  int W() const { return w; }
+  int Length() const { return top.Length(); }  // min(k, samples in window)
+  bool Largest() const { return largest; }
+  long long Count() const { return count; }  // number of samples pushed so far
+
+  /* Current admission threshold (k-th best in the window); only defined
+     once k samples are kept */
+
+  bool Threshold(V *v) const {
+    if (k == 0 || top.Length() != k) return false;
+    return largest ? top.PeekMinValue(v) : top.PeekMaxValue(v);
+  }
+
+  /* Both ends of the kept samples; indices are stream positions */
+
+  bool PeekMinValue(V *v) const { return top.PeekMinValue(v); }
+  bool PeekMaxValue(V *v) const { return top.PeekMaxValue(v); }
+
+  bool PeekMinIndex(I *i) const {
+    int slot;
+    if (i == nullptr || !top.PeekMinIndex(&slot)) return false;
+    *i = __position(slot);
+    return true;
+  }
+
+  bool PeekMaxIndex(I *i) const {
+    int slot;
+    if (i == nullptr || !top.PeekMaxIndex(&slot)) return false;
+    *i = __position(slot);
+    return true;
+  }
+
+  /* Push the next sample; the sample at position Count() - w expires */
+
+  void Push(V v) {
+    if (k == 0) {
+      count++;
+      return;
+    }
+    int slot = (int) (count % w);
+    V t = V();
+    if (count >= w) {
+      if (rest.Contains(slot)) {
+        if (!__admits(v)) {
+          rest.Update(slot, std::move(v));  // common case; top is unchanged
+          count++;
+          return;
+        }
+        rest.Erase(slot);
+      } else {
+        top.Erase(slot);
+        if (__best(rest, &t) && !__better(v, t)) {
+          int s = 0;
+          largest ? rest.PeekMaxIndex(&s) : rest.PeekMinIndex(&s);
+          largest ? rest.RemoveMax() : rest.RemoveMin();
+          top.Insert(std::move(t), s);
+          rest.Insert(std::move(v), slot);
+        } else {
+          top.Insert(std::move(v), slot);
+        }
+        count++;
+        return;
+      }
+    }
+    if (top.Length() < k) {
+      top.Insert(std::move(v), slot);
+    } else if (__admits(v)) {
+      // the k-th best moves down to rest
+      int s = 0;
+      if (largest) {
+        top.PeekMinValue(&t);
+        top.PeekMinIndex(&s);
+        top.RemoveMin();
+      } else {
+        top.PeekMaxValue(&t);
+        top.PeekMaxIndex(&s);
+        top.RemoveMax();
+      }
+      rest.Insert(std::move(t), s);
+      top.Insert(std::move(v), slot);
+    } else {
+      rest.Insert(std::move(v), slot);
+    }
+    count++;
+  }
+
+  template <class T>
+  void Scan(const T *x, int n) {
+    for (int j = 0; j < n; j++) Push(x[j]);
+  }
+
+  /* Copy the kept samples into xk and ik (either may be nullptr) and
+     return their number: ascending for k-smallest, descending for
+     k-largest. The window is not changed; O(k log(k)). */
+
+  int Emit(V *xk, I *ik) const {
+    MinMaxHeap<V, I> h(top.Length());
+    V v = V();
+    int slot;
+    for (int p = 1; top.PeekAt(p, &v, &slot); p++) h.Insert(v, __position(slot));
+    return largest ? h.DrainDescending(xk, ik) : h.DrainAscending(xk, ik);
+  }
+
+  void Clear() {
+    top.Clear();
+    rest.Clear();
+    count = 0;
+  }
+
+private:
+  bool __better(const V& a, const V& b) const { return largest ? (b < a) : (a < b); }
+
+  bool __admits(const V& v) const {
+    V t = V();
+    return top.Length() < k || (Threshold(&t) && __better(v, t));
+  }
+
+  bool __best(const AddressableMinMaxHeap<V, int, L, D>& h, V *v) const {
+    return largest ? h.PeekMaxValue(v) : h.PeekMinValue(v);
+  }
+
+  // stream position of the sample in slot s (the newest is Count() - 1)
+  I __position(int s) const {
+    long long last = count - 1;
+    int ls = (int) (last % w);
+    return (I) (last - (ls - s + w) % w);
+  }
+
+  AddressableMinMaxHeap<V, int, L, D> top;
+  AddressableMinMaxHeap<V, int, L, D> rest;
+  int k;
+  int w;
+  bool largest;
+  long long count;
+};
+
+/* Convenience wrappers with the same contract as ksmallest()/klargest()
+   in cmmheap-test.c; O(n log k). Returns min(n,k). */
+
+template <class V, class I>
+int KSmallest(const V *x, int n, int k, V *xk, I *ik) {
+  TopK<V, I> tk(k, false);
+  tk.Scan(x, n);
+  return tk.Emit(xk, ik);
+}
+
+template <class V, class I>
+int KLargest(const V *x, int n, int k, V *xk, I *ik) {
+  TopK<V, I> tk(k, true);
+  tk.Scan(x, n);
+  return tk.Emit(xk, ik);
+}
+
+/*
+ * RunningQuantile tracks the q-quantile of a stream (nearest rank: the
+ * ceil(q*n)-th smallest of n samples; q = 0.5 is the lower median). The
+ * samples at or below the quantile are kept in one keys-only MinMaxHeap
+ * (lo, quantile = its max) and the rest in another (hi). A push that
+ * moves the boundary swaps one sample across with a Replace op, so it
+ * costs at most one Replace and one Insert: O(log n); Quantile is O(1).
+ *
+ * With a capacity each heap holds at most that many samples: on overflow
+ * lo drops its min and hi its max, the ends farthest from the target
+ * rank, and only their counts are kept. The result stays exact as long
+ * as the target rank never reaches a dropped sample; Exact() reports it.
+ */
+
+template <class V, class L = MinMaxHeapLayout::Split, int D = 2>
+class RunningQuantile
+{
+public:
+  RunningQuantile(double q = 0.5, int capacity = 0) :
+    lo(capacity > 0 ? capacity : 16, capacity <= 0),
+    hi(capacity > 0 ? capacity : 16, capacity <= 0),
+    q(q < 0.0 ? 0.0 : (q > 1.0 ? 1.0 : q)), capacity(capacity > 0 ? capacity : 0),
+    count(0), dlo(0), dhi(0), dlomax(), dhimin(), exact(true) { }
+
+  double Q() const { return q; }
+  int Capacity() const { return capacity; }  // 0 if unbounded
+  long long Count() const { return count; }  // number of samples pushed
+  long long Dropped() const { return dlo + dhi; }
+
+  bool Exact() const {
+    V t = V();
+    return exact && (dlo == 0 || (lo.PeekMaxValue(&t) && !(t < dlomax)));
+  }
+
+  void Push(V v) {
+    V t = V();
+    count++;
+    bool grow = (dlo + lo.Length() < __rank());  // lo gains one sample
+    if (lo.PeekMaxValue(&t) && !(t < v)) {
+      if (grow) {
+        __add_lo(std::move(v));
+      } else {
+        // v enters lo and the old max of lo crosses over
+        if (dlo != 0 && t < dlomax) exact = false;
+        lo.ReplaceMax(std::move(v));
+        __add_hi(std::move(t));
+      }
+    } else {
+      if (!grow) {
+        __add_hi(std::move(v));
+      } else if (hi.PeekMinValue(&t) && t < v) {
+        if (dhi != 0 && dhimin < t) exact = false;
+        hi.ReplaceMin(std::move(v));
+        __add_lo(std::move(t));
+      } else {
+        if (dhi != 0 && dhimin < v) exact = false;
+        __add_lo(std::move(v));
+      }
+    }
+  }
+
+  template <class It>
+  void Push(It first, It last) {
+    for (; first != last; ++first) Push(*first);
+  }
+
+  /* Current quantile; false if nothing has been pushed */
+
+  bool Quantile(V *v) const {
+    return lo.PeekMaxValue(v);
+  }
+
+  void Clear() {
+    lo.Clear();
+    hi.Clear();
+    count = dlo = dhi = 0;
+    exact = true;
+  }
+
+private:
+  // insert into lo; at capacity the smaller of v and the min of lo is dropped
+  void __add_lo(V v) {
+    V t = V();
+    if (capacity == 0 || lo.Length() < capacity) {
+      lo.Insert(std::move(v));
+      return;
+    }
+    lo.PeekMinValue(&t);
+    if (t < v) {
+      lo.ReplaceMin(std::move(v));
+    } else {
+      t = std::move(v);
+    }
+    if (dlo == 0 || dlomax < t) dlomax = std::move(t);
+    dlo++;
+  }
+
+  void __add_hi(V v) {
+    V t = V();
+    if (capacity == 0 || hi.Length() < capacity) {
+      hi.Insert(std::move(v));
+      return;
+    }
+    hi.PeekMaxValue(&t);
+    if (v < t) {
+      hi.ReplaceMax(std::move(v));
+    } else {
+      t = std::move(v);
+    }
+    if (dhi == 0 || t < dhimin) dhimin = std::move(t);
+    dhi++;
+  }
+
+  // 1-based target rank ceil(q * count), at least 1
+  long long __rank() const {
+    double x = q * (double) count;
+    long long r = (long long) x;
+    if ((double) r < x) r++;
+    return (r < 1) ? 1 : r;
+  }
+
+  MinMaxHeap<V, void, L, D> lo;
+  MinMaxHeap<V, void, L, D> hi;
+  double q;
+  int capacity;
+  long long count;
+  long long dlo;  // samples dropped from lo (all at or below the quantile)
+  long long dhi;  // samples dropped from hi
+  V dlomax;       // largest sample dropped from lo
+  V dhimin;       // smallest sample dropped from hi
+  bool exact;
 };
 
 #endif
@@ -0,0 +1,464 @@
+/*
+ * pmmheap.h
+ *
+ * Multi-threaded applications of the C++ template min-max-heap (mmheap.h).
+ *
+ * ParallelKSmallest() / ParallelKLargest() split the input array into one
+ * contiguous chunk per thread. Each worker keeps its own MinMaxHeap of
+ * capacity k, and the workers share the best full-heap threshold seen so
+ * far (smallest heap max for k-smallest, largest heap min for k-largest)
+ * through an atomic, so that a worker can reject elements that another
+ * worker has already proven useless. The per-thread heaps are merged into
+ * one k-bounded heap at the end (MergeBounded), and the result is emitted in sorted order
+ * (same contract as KSmallest() / KLargest()).
+ *
+ * Threads are created per call; the calling thread runs the first chunk.
+ *
+ * ShardedMinMaxHeap is a concurrent double-ended priority queue made of
+ * MinMaxHeap shards, each behind its own mutex (MultiQueue style).
+ *
+ * IngestTopK puts a lock-free ring (IngestRing) in front of a TopK owned
+ * by one consumer thread; producers read the published threshold and
+ * drop hopeless candidates before enqueueing.
+ *
+ */
+
+#ifndef __PMMHEAP_H__
+#define __PMMHEAP_H__
+
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "mmheap.h"
+
+namespace MinMaxHeapAux
+{
+
+// elements scanned between reloads of the shared threshold
+const std::ptrdiff_t __par_block = 1 << 14;
+
+template <bool Largest, class V>
+static inline bool __better(const V &a, const V &b) {
+  return Largest ? (a > b) : (a < b);
+}
+
+template <bool Largest, class V>
+static inline V __worst_value() {
+  typedef std::numeric_limits<V> L;
+  if (Largest) return L::has_infinity ? -L::infinity() : L::lowest();
+  return L::has_infinity ? L::infinity() : L::max();
+}
+
+// lower (k-smallest) or raise (k-largest) the shared threshold to t
+template <bool Largest, class V>
+static inline void __publish(std::atomic<V> *shared, V t) {
+  V cur = shared->load(std::memory_order_relaxed);
+  while (__better<Largest>(t, cur) &&
+         !shared->compare_exchange_weak(cur, t, std::memory_order_relaxed)) { }
+}
+
+template <bool Largest, class V, class I>
+static void __topk_worker(const V *x, std::ptrdiff_t lo, std::ptrdiff_t hi,
+                          MinMaxHeap<V, I> *heap, std::atomic<V> *shared)
+{
+  std::ptrdiff_t j = lo;
+  while (j < hi && heap->Length() != heap->MaxLength()) {
+    heap->Insert(x[j], I(j));
+    j++;
+  }
+  if (j == hi) return;
+
+  V t = V();
+  if (Largest) heap->PeekMinValue(&t); else heap->PeekMaxValue(&t);
+  __publish<Largest>(shared, t);
+
+  while (j < hi) {
+    std::ptrdiff_t end = (hi - j > __par_block) ? j + __par_block : hi;
+    V s = shared->load(std::memory_order_relaxed);
+    V tt = __better<Largest>(s, t) ? s : t;
+    for (;;) {
+      const V *p = __first_past<Largest>(x + j, x + end, tt, j);
+      if (p == x + end) break;
+      if (Largest) {
+        heap->ReplaceMin(*p, I(j));
+        heap->PeekMinValue(&t);
+      } else {
+        heap->ReplaceMax(*p, I(j));
+        heap->PeekMaxValue(&t);
+      }
+      __publish<Largest>(shared, t);
+      if (__better<Largest>(t, tt)) tt = t;
+      j++;
+    }
+  }
+}
+
+template <bool Largest, class V, class I>
+static int __parallel_topk(const V *x, std::ptrdiff_t n, int k, V *xk, I *ik, int nthreads)
+{
+  if (k <= 0) return 0;  // nothing selected (MinMaxHeap would clamp k to 1)
+  if (nthreads < 1) nthreads = 1;
+  if (n / nthreads < k) nthreads = 1;  // not worth splitting
+
+  std::atomic<V> shared(__worst_value<Largest, V>());
+  std::vector<std::unique_ptr<MinMaxHeap<V, I> > > heaps;
+  std::vector<std::thread> workers;
+
+  for (int t = 0; t < nthreads; t++) {
+    heaps.emplace_back(new MinMaxHeap<V, I>(k));
+  }
+  for (int t = 1; t < nthreads; t++) {
+    std::ptrdiff_t lo = (n * t) / nthreads;
+    std::ptrdiff_t hi = (n * (t + 1)) / nthreads;
+    workers.emplace_back(__topk_worker<Largest, V, I>, x, lo, hi, heaps[t].get(), &shared);
+  }
+  __topk_worker<Largest, V, I>(x, 0, n / nthreads, heaps[0].get(), &shared);
+  for (auto &w : workers) w.join();
+
+  // k-bounded merge of the per-thread heaps into the first one
+  MinMaxHeap<V, I> &merged = *heaps[0];
+  for (int t = 1; t < nthreads; t++) {
+    merged.MergeBounded(*heaps[t], k, Largest);
+  }
+  return Largest ? merged.DrainDescending(xk, ik) : merged.DrainAscending(xk, ik);
+}
+
+// per-thread xorshift state for shard sampling
+static inline unsigned __shard_rand() {
+  static thread_local unsigned x = 0;
+  if (x == 0) {
+    x = (unsigned) std::hash<std::thread::id>()(std::this_thread::get_id()) | 1u;
+  }
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+} // end aux. namespace
+
+/* Multi-threaded versions of KSmallest()/KLargest(); O(n log k / nthreads).
+   Returns min(n,k). */
+
+template <class V, class I>
+int ParallelKSmallest(const V *x, std::ptrdiff_t n, int k, V *xk, I *ik, int nthreads) {
+  return MinMaxHeapAux::__parallel_topk<false, V, I>(x, n, k, xk, ik, nthreads);
+}
+
+template <class V, class I>
+int ParallelKLargest(const V *x, std::ptrdiff_t n, int k, V *xk, I *ik, int nthreads) {
+  return MinMaxHeapAux::__parallel_topk<true, V, I>(x, n, k, xk, ik, nthreads);
+}
+
+/*
+ * ShardedMinMaxHeap<V, I>: nshards growable MinMaxHeap shards, each with
+ * its own lock, and each publishing its current min and max (atomics) so
+ * that shards can be compared without locking.
+ *
+ * Insert goes to a random shard (another one if the lock is taken).
+ * In relaxed mode (default) RemoveMin/RemoveMax sample two random shards
+ * and pop from the one with the better end, so they return an element
+ * near, but not necessarily at, the global min/max; Peeks do the same
+ * without removing. In exact mode they lock all shards in order and take
+ * the true global min/max (the exact Peeks read the published ends of
+ * all shards without locking). V must be usable in std::atomic.
+ */
+
+template <class V, class I>
+class ShardedMinMaxHeap
+{
+public:
+  ShardedMinMaxHeap(int nshards, int m = 1024, bool exact = false) :
+    shards(nshards < 1 ? 1 : nshards), exact(exact) {
+    for (int j = 0; j < (int) shards.size(); j++) {
+      shards[j].reset(new shard(m));
+    }
+  }
+
+  int Shards() const { return (int) shards.size(); }
+  bool Exact() const { return exact; }
+
+  // number of elements; exact only while no other thread is in an op
+  int Length() const {
+    int n = 0;
+    for (auto &h : shards) n += h->length.load(std::memory_order_relaxed);
+    return n;
+  }
+
+  bool Insert(V v, I i) {
+    int ns = (int) shards.size();
+    int j = (int) (MinMaxHeapAux::__shard_rand() % (unsigned) ns);
+    for (int tries = 0; !shards[j]->mutex.try_lock(); tries++) {
+      if (tries == ns) {
+        shards[j]->mutex.lock();
+        break;
+      }
+      j = (int) (MinMaxHeapAux::__shard_rand() % (unsigned) ns);
+    }
+    bool ok = shards[j]->heap.Insert(v, i);
+    shards[j]->publish();
+    shards[j]->mutex.unlock();
+    return ok;
+  }
+
+  bool RemoveMin(V *v, I *i) { return exact ? __remove_exact<false>(v, i) : __remove_relaxed<false>(v, i); }
+  bool RemoveMax(V *v, I *i) { return exact ? __remove_exact<true>(v, i) : __remove_relaxed<true>(v, i); }
+
+  bool PeekMin(V *v) const { return __peek<false>(v); }
+  bool PeekMax(V *v) const { return __peek<true>(v); }
+
+private:
+  struct alignas(64) shard {
+    shard(int m) : heap(m, true), min(MinMaxHeapAux::__worst_value<false, V>()),
+                   max(MinMaxHeapAux::__worst_value<true, V>()), length(0) { }
+
+    // refresh the published ends; called with the lock held
+    void publish() {
+      V t = V();
+      min.store(heap.PeekMinValue(&t) ? t : MinMaxHeapAux::__worst_value<false, V>(), std::memory_order_relaxed);
+      max.store(heap.PeekMaxValue(&t) ? t : MinMaxHeapAux::__worst_value<true, V>(), std::memory_order_relaxed);
+      length.store(heap.Length(), std::memory_order_relaxed);
+    }
+
+    std::mutex mutex;
+    MinMaxHeap<V, I> heap;
+    std::atomic<V> min;
+    std::atomic<V> max;
+    std::atomic<int> length;
+  };
+
+  template <bool Max>
+  const std::atomic<V>& __end(int j) const { return Max ? shards[j]->max : shards[j]->min; }
+
+  // better of two random nonempty shards by their published ends; -1 if both are empty
+  template <bool Max>
+  int __sample() const {
+    int ns = (int) shards.size();
+    int a = (int) (MinMaxHeapAux::__shard_rand() % (unsigned) ns);
+    int b = (int) (MinMaxHeapAux::__shard_rand() % (unsigned) ns);
+    bool ea = shards[a]->length.load(std::memory_order_relaxed) == 0;
+    bool eb = shards[b]->length.load(std::memory_order_relaxed) == 0;
+    if (ea && eb) return -1;
+    if (ea) return b;
+    if (eb) return a;
+    V va = __end<Max>(a).load(std::memory_order_relaxed);
+    V vb = __end<Max>(b).load(std::memory_order_relaxed);
+    return MinMaxHeapAux::__better<Max>(vb, va) ? b : a;
+  }
+
+  template <bool Max>
+  bool __pop(shard &h, V *v, I *i) {
+    if (h.heap.Length() == 0) return false;
+    if (Max) {
+      h.heap.PeekMaxValue(v);
+      h.heap.PeekMaxIndex(i);
+      h.heap.RemoveMax();
+    } else {
+      h.heap.PeekMinValue(v);
+      h.heap.PeekMinIndex(i);
+      h.heap.RemoveMin();
+    }
+    h.publish();
+    return true;
+  }
+
+  template <bool Max>
+  bool __remove_relaxed(V *v, I *i) {
+    int ns = (int) shards.size();
+    for (int tries = 0; tries < 2 * ns; tries++) {
+      int j = __sample<Max>();
+      if (j < 0) continue;
+      shard &h = *shards[j];
+      if (!h.mutex.try_lock()) continue;
+      bool ok = __pop<Max>(h, v, i);
+      h.mutex.unlock();
+      if (ok) return true;
+    }
+    // sampling keeps missing: sweep all shards once
+    for (int j = 0; j < ns; j++) {
+      std::lock_guard<std::mutex> g(shards[j]->mutex);
+      if (__pop<Max>(*shards[j], v, i)) return true;
+    }
+    return false;
+  }
+
+  template <bool Max>
+  bool __remove_exact(V *v, I *i) {
+    int ns = (int) shards.size();
+    for (int j = 0; j < ns; j++) shards[j]->mutex.lock();
+    int best = -1;
+    V t = V(), bt = V();
+    for (int j = 0; j < ns; j++) {
+      bool ok = Max ? shards[j]->heap.PeekMaxValue(&t) : shards[j]->heap.PeekMinValue(&t);
+      if (ok && (best < 0 || MinMaxHeapAux::__better<Max>(t, bt))) {
+        best = j;
+        bt = t;
+      }
+    }
+    bool ok = (best >= 0) && __pop<Max>(*shards[best], v, i);
+    for (int j = ns - 1; j >= 0; j--) shards[j]->mutex.unlock();
+    return ok;
+  }
+
+  template <bool Max>
+  bool __peek(V *v) const {
+    if (exact) {
+      bool any = false;
+      for (int j = 0; j < (int) shards.size(); j++) {
+        if (shards[j]->length.load(std::memory_order_relaxed) == 0) continue;
+        V t = __end<Max>(j).load(std::memory_order_relaxed);
+        if (!any || MinMaxHeapAux::__better<Max>(t, *v)) *v = t;
+        any = true;
+      }
+      return any;
+    }
+    int j = __sample<Max>();
+    if (j < 0) return false;
+    *v = __end<Max>(j).load(std::memory_order_relaxed);
+    return true;
+  }
+
+  std::vector<std::unique_ptr<shard> > shards;
+  bool exact;
+};
+
+/*
+ * IngestRing<T, MultiProducer>: bounded lock-free ring with a single
+ * consumer (capacity rounded up to a power of two). Each cell carries a
+ * sequence number telling whether it is free for the producer of a given
+ * ticket or ready for the consumer. With MultiProducer (MPSC) producers
+ * claim tickets with a CAS on the tail; a single producer (SPSC) just
+ * stores it. Push fails when the ring is full.
+ */
+
+template <class T, bool MultiProducer = true>
+class IngestRing
+{
+public:
+  IngestRing(int capacity) : head(0), tail(0) {
+    std::size_t c = 2;
+    while (c < (std::size_t) capacity) c <<= 1;
+    mask = c - 1;
+    cells.reset(new cell[c]);
+    for (std::size_t j = 0; j < c; j++) cells[j].seq.store(j, std::memory_order_relaxed);
+  }
+
+  int Capacity() const { return (int) (mask + 1); }
+
+  /* producer side */
+
+  bool Push(const T& d) {
+    std::size_t pos = tail.load(std::memory_order_relaxed);
+    cell *c;
+    for (;;) {
+      c = &cells[pos & mask];
+      std::size_t seq = c->seq.load(std::memory_order_acquire);
+      std::ptrdiff_t dif = (std::ptrdiff_t) seq - (std::ptrdiff_t) pos;
+      if (dif == 0) {
+        if (!MultiProducer) {
+          tail.store(pos + 1, std::memory_order_relaxed);
+          break;
+        }
+        if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      } else if (dif < 0) {
+        return false;  // full
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+    c->data = d;
+    c->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  /* consumer side; up to n elements into out, returns the number popped */
+
+  int Pop(T *out, int n) {
+    int j = 0;
+    while (j < n) {
+      cell &c = cells[head & mask];
+      if (c.seq.load(std::memory_order_acquire) != head + 1) break;
+      out[j++] = c.data;
+      c.seq.store(head + mask + 1, std::memory_order_release);
+      head++;
+    }
+    return j;
+  }
+
+private:
+  struct cell {
+    std::atomic<std::size_t> seq;
+    T data;
+  };
+
+  std::unique_ptr<cell[]> cells;
+  std::size_t mask;
+  alignas(64) std::size_t head;  // consumer only
+  alignas(64) std::atomic<std::size_t> tail;
+};
+
+/*
+ * IngestTopK<V, I, MultiProducer>: k-smallest (or k-largest) of values
+ * offered by producer threads, kept by one consumer thread. Offer()
+ * drops a candidate that cannot beat the published threshold and
+ * enqueues the rest; the consumer calls Drain() to pop batches, filter
+ * them against the current threshold and apply them with
+ * Insert/ReplaceMax (ReplaceMin), then republish the threshold.
+ */
+
+template <class V, class I, bool MultiProducer = true>
+class IngestTopK
+{
+public:
+  IngestTopK(int k, bool largest = false, int ringsize = 1 << 14, int batch = 256) :
+    topk(k, largest), ring(ringsize), buffer(new std::pair<V, I>[batch < 1 ? 1 : batch]),
+    batch(batch < 1 ? 1 : batch), largest(largest),
+    threshold(largest ? MinMaxHeapAux::__worst_value<true, V>() : MinMaxHeapAux::__worst_value<false, V>()) { }
+
+  /* producer side; false if the ring is full (the candidate is not taken) */
+
+  bool Offer(V v, I i) {
+    V t = threshold.load(std::memory_order_relaxed);
+    if (largest ? !(v > t) : !(v < t)) return true;  // hopeless; dropped
+    return ring.Push(std::make_pair(v, i));
+  }
+
+  /* consumer side; returns the number of candidates popped */
+
+  int Drain() {
+    int total = 0;
+    for (;;) {
+      int n = ring.Pop(buffer.get(), batch);
+      if (n == 0) break;
+      total += n;
+      V t = V();
+      bool full = topk.Threshold(&t);
+      for (int j = 0; j < n; j++) {
+        const V& v = buffer[j].first;
+        if (full && (largest ? !(v > t) : !(v < t))) continue;
+        topk.Push(v, buffer[j].second);
+        full = topk.Threshold(&t);
+      }
+      if (full) threshold.store(t, std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+  const TopK<V, I>& Result() const { return topk; }
+  int Emit(V *xk, I *ik) { return topk.Emit(xk, ik); }
+
+private:
+  TopK<V, I> topk;
+  IngestRing<std::pair<V, I>, MultiProducer> ring;
+  std::unique_ptr<std::pair<V, I>[]> buffer;
+  int batch;
+  bool largest;
+  alignas(64) std::atomic<V> threshold;
+};
+
+#endif